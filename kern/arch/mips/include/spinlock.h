@@ -43,6 +43,10 @@ typedef unsigned spinlock_data_t;
 void spinlock_data_set(volatile spinlock_data_t *sd, unsigned val);
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
+spinlock_data_t spinlock_data_fetchadd(volatile spinlock_data_t *sd,
+				       unsigned val);
+spinlock_data_t spinlock_data_compareswap(volatile spinlock_data_t *sd,
+					  unsigned oldval, unsigned newval);
 
 ////////////////////////////////////////////////////////////
 
@@ -93,5 +97,69 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_fetchadd(volatile spinlock_data_t *sd, unsigned val)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	/*
+	 * Fetch-and-add using LL/SC. Unlike testandset this can't
+	 * just report failure, so retry until the SC succeeds.
+	 *
+	 * Load the existing value into X and store X+VAL from Y.
+	 * Returns the value from before the add.
+	 */
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set noreorder;"	/* we fill the delay slot ourselves */
+		"1: ll %0, 0(%2);"	/*   x = *sd */
+		"addu %1, %0, %3;"	/*   y = x + val */
+		"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+		"beqz %1, 1b;"		/*   if (!y) try again */
+		"nop;"			/*   (delay slot) */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y) : "r" (sd), "r" (val) : "memory");
+	return x;
+}
+
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_compareswap(volatile spinlock_data_t *sd,
+			  unsigned oldval, unsigned newval)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	/*
+	 * Compare-and-swap using LL/SC: if *SD is OLDVAL, replace it
+	 * with NEWVAL. Returns the value found, so the swap happened
+	 * if and only if that equals OLDVAL. Like fetchadd, retry if
+	 * the SC fails; otherwise we might report a mismatch that
+	 * didn't happen.
+	 */
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set noreorder;"	/* we fill the delay slots ourselves */
+		"1: ll %0, 0(%2);"	/*   x = *sd */
+		"bne %0, %3, 2f;"	/*   if (x != oldval) give up */
+		"move %1, %4;"		/*   (delay slot) y = newval */
+		"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+		"beqz %1, 1b;"		/*   if (!y) try again */
+		"nop;"			/*   (delay slot) */
+		"2: .set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y)
+		: "r" (sd), "r" (oldval), "r" (newval)
+		: "memory");
+	return x;
+}
+
 
 #endif /* _MIPS_SPINLOCK_H_ */
@@ -37,7 +37,7 @@
  *        into a "random" TLB slot chosen by the processor.
  *
  *        IMPORTANT NOTE: never write more than one TLB entry with the
- *        same virtual page field.
+ *        same virtual page and PID fields.
  *
  *   tlb_write: same as tlb_random, but you choose the slot.
  *
@@ -53,20 +53,26 @@
  *        is not set. To completely invalidate the TLB, load it with
  *        translations for addresses in one of the unmapped address
  *        ranges - these will never be matched.
+ *
+ *   tlb_setpid: set the address space ID that TLB lookups match
+ *        against. PID must be less than NUM_TLBPID.
  */
 
 void tlb_random(uint32_t entryhi, uint32_t entrylo);
 void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
+void tlb_setpid(uint32_t pid);
 
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * Note that the MIPS has support for a 6-bit address space ID. Entries
+ * only match when their TLBHI_PID equals the PID in the processor's
+ * entryhi register; tlb_setpid sets that. (The tlb_* functions above
+ * also load entryhi, so set the PID again after using them if it
+ * matters.) TLBLO_GLOBAL entries match any PID; we don't use it. Bits
+ * that aren't assigned a meaning can be left zero.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -78,7 +84,8 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -101,5 +108,11 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 #define NUM_TLB  64
 
+/*
+ * Number of address space IDs.
+ */
+
+#define NUM_TLBPID  64
+
 
 #endif /* _MIPS_TLB_H_ */
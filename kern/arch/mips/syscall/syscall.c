@@ -129,6 +129,15 @@ syscall(struct trapframe *tf)
 			    (int)tf->tf_a2,
 			    (pid_t *)&retval);
 	  break;
+	case SYS_futex_wait:
+	  err = sys_futex_wait((userptr_t)tf->tf_a0,
+			       (int)tf->tf_a1);
+	  break;
+	case SYS_futex_wake:
+	  err = sys_futex_wake((userptr_t)tf->tf_a0,
+			       (int)tf->tf_a1,
+			       (int *)(&retval));
+	  break;
 #endif // UW
 
 	    /* Add stuff here */
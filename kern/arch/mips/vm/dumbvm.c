@@ -34,9 +34,12 @@
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
+#include <cpu.h>
 #include <mips/tlb.h>
+#include <platform/maxcpus.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <uw-vmstats.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -45,18 +48,353 @@
  * assignment, this file is not included in your kernel!
  */
 
-/* under dumbvm, always have 48k of user stack */
-#define DUMBVM_STACKPAGES    12
+/*
+ * Size of the user stack region. Pages are only allocated when
+ * touched, so this can be generous.
+ */
+#define DUMBVM_STACKPAGES    256
+
+/*
+ * Physical page allocator.
+ *
+ * Until vm_bootstrap runs, pages come from ram_stealmem and can never
+ * be given back. vm_bootstrap takes everything ram_getsize reports
+ * that's left, keeps a table (the coremap) at the bottom of it with
+ * one entry per page frame in the rest, and from then on allocates
+ * and frees frames through the table.
+ *
+ * Free frames are kept by a binary buddy system: blocks of 2^n
+ * frames, aligned to 2^n, on one free list per order, linked through
+ * the coremap entries. An allocation of N frames takes a block of
+ * the next power of two up, splitting bigger blocks as needed, and
+ * gives the unused tail straight back. Freeing a run breaks it into
+ * aligned power-of-two blocks and merges each with its buddy for as
+ * long as the buddy is free too. The first frame's entry records the
+ * run length so free can find it.
+ *
+ * Single pages, which is what kmalloc refills and most other callers
+ * want, mostly don't get that far. Each cpu keeps a magazine of free
+ * pages. Pages freed on a cpu go on top of its magazine and are the
+ * first handed out again, while they're likely still in the cache;
+ * when the magazine fills, the bottom (coldest) part goes back to
+ * the buddy lists, and when it empties it's refilled with a batch at
+ * a time. So coremap_lock is only taken about once per
+ * VM_MAGAZINE_BATCH single-page operations. Each magazine has its own
+ * lock, which normally only its cpu takes; another cpu that has run
+ * out of memory can empty it.
+ *
+ * Lock order: a magazine lock, then coremap_lock. coremap_lock also
+ * wraps ram_stealmem before the coremap exists.
+ */
+
+#define BUDDY_NORDERS		11	/* blocks of up to 1024 pages */
+#define VM_MAGAZINE_SIZE	32
+#define VM_MAGAZINE_BATCH	16	/* pages moved at once */
+
+struct coremap_entry {
+	unsigned cme_used:1;		/* allocated, or in a magazine */
+	unsigned cme_free:1;		/* first frame of a free block */
+	unsigned cme_order:5;		/* order of the free block */
+	unsigned cme_npages:25;		/* run length, in first frame */
+	int cme_next, cme_prev;		/* buddy free list links */
+};
+
+struct vm_magazine {
+	struct spinlock vm_lock;
+	unsigned vm_count;
+	unsigned vm_frames[VM_MAGAZINE_SIZE];	/* free, top is hottest */
+};
+
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+static struct coremap_entry *coremap;
+static paddr_t coremap_base;		/* physical address of frame 0 */
+static unsigned coremap_npages;		/* number of frames */
+static unsigned coremap_nfree;		/* frames on the buddy lists */
+static int buddy_lists[BUDDY_NORDERS];	/* first frame, or -1 */
+static struct vm_magazine magazines[MAXCPUS];
+
+static
+void
+buddy_insert(unsigned frame, unsigned order)
+{
+	struct coremap_entry *cme = &coremap[frame];
+
+	cme->cme_free = 1;
+	cme->cme_order = order;
+	cme->cme_prev = -1;
+	cme->cme_next = buddy_lists[order];
+	if (cme->cme_next >= 0) {
+		coremap[cme->cme_next].cme_prev = frame;
+	}
+	buddy_lists[order] = frame;
+}
+
+static
+void
+buddy_remove(unsigned frame)
+{
+	struct coremap_entry *cme = &coremap[frame];
+
+	KASSERT(cme->cme_free);
+	if (cme->cme_prev >= 0) {
+		coremap[cme->cme_prev].cme_next = cme->cme_next;
+	}
+	else {
+		buddy_lists[cme->cme_order] = cme->cme_next;
+	}
+	if (cme->cme_next >= 0) {
+		coremap[cme->cme_next].cme_prev = cme->cme_prev;
+	}
+	cme->cme_free = 0;
+}
+
+/*
+ * Put frames FROM through TO-1 on the buddy lists, merging with free
+ * buddies.
+ */
+static
+void
+buddy_free_range(unsigned from, unsigned to)
+{
+	unsigned frame, order, buddy, size;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	coremap_nfree += to - from;
+	while (from < to) {
+		/* The biggest aligned block that starts here and fits. */
+		order = 0;
+		while (order + 1 < BUDDY_NORDERS &&
+		       from % (1U << (order + 1)) == 0 &&
+		       from + (1U << (order + 1)) <= to) {
+			order++;
+		}
+		size = 1U << order;
+
+		frame = from;
+		while (order + 1 < BUDDY_NORDERS) {
+			buddy = frame ^ (1U << order);
+			if (buddy >= coremap_npages ||
+			    !coremap[buddy].cme_free ||
+			    coremap[buddy].cme_order != order) {
+				break;
+			}
+			buddy_remove(buddy);
+			if (buddy < frame) {
+				frame = buddy;
+			}
+			order++;
+		}
+		buddy_insert(frame, order);
+		from += size;
+	}
+}
+
+/*
+ * Take NPAGES contiguous frames off the buddy lists and mark them
+ * allocated. Returns the first frame, or -1.
+ */
+static
+int
+buddy_alloc(unsigned npages)
+{
+	unsigned want, order, i;
+	int frame;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	want = 0;
+	while ((1U << want) < npages) {
+		want++;
+	}
+	for (order = want; order < BUDDY_NORDERS; order++) {
+		if (buddy_lists[order] >= 0) {
+			break;
+		}
+	}
+	if (order >= BUDDY_NORDERS) {
+		return -1;
+	}
+
+	frame = buddy_lists[order];
+	buddy_remove(frame);
+	coremap_nfree -= 1U << order;
+
+	/* Split off upper halves until it's the size we want... */
+	while (order > want) {
+		order--;
+		buddy_insert(frame + (1U << order), order);
+		coremap_nfree += 1U << order;
+	}
+	/* ...and give back the tail past what was asked for. */
+	buddy_free_range(frame + npages, frame + (1U << want));
+
+	for (i=frame; i<frame+npages; i++) {
+		KASSERT(!coremap[i].cme_used && !coremap[i].cme_free);
+		coremap[i].cme_used = 1;
+		coremap[i].cme_npages = 0;
+	}
+	coremap[frame].cme_npages = npages;
+	return frame;
+}
+
+/*
+ * Give back a run from buddy_alloc.
+ */
+static
+void
+buddy_release(unsigned frame)
+{
+	unsigned npages, i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	npages = coremap[frame].cme_npages;
+	KASSERT(coremap[frame].cme_used && npages > 0);
+	KASSERT(frame + npages <= coremap_npages);
+
+	for (i=frame; i<frame+npages; i++) {
+		coremap[i].cme_used = 0;
+		coremap[i].cme_npages = 0;
+	}
+	buddy_free_range(frame, frame + npages);
+}
 
 /*
- * Wrap rma_stealmem in a spinlock.
+ * Return everything in a magazine to the buddy lists.
  */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+static
+void
+magazine_drain(struct vm_magazine *mag)
+{
+	KASSERT(spinlock_do_i_hold(&mag->vm_lock));
+
+	spinlock_acquire(&coremap_lock);
+	while (mag->vm_count > 0) {
+		buddy_release(mag->vm_frames[--mag->vm_count]);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Out of memory: collect what every cpu has squirreled away.
+ */
+static
+void
+magazine_drain_all(void)
+{
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		spinlock_acquire(&magazines[i].vm_lock);
+		magazine_drain(&magazines[i]);
+		spinlock_release(&magazines[i].vm_lock);
+	}
+}
 
 void
 vm_bootstrap(void)
 {
-	/* Do nothing. */
+	paddr_t lo, hi;
+	unsigned npages, i;
+	size_t size;
+
+	for (i=0; i<MAXCPUS; i++) {
+		spinlock_init(&magazines[i].vm_lock);
+		magazines[i].vm_count = 0;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	ram_getsize(&lo, &hi);
+	lo = ROUNDUP(lo, PAGE_SIZE);
+
+	/* Put the table at the bottom, then manage the rest. */
+	npages = (hi - lo) / PAGE_SIZE;
+	size = ROUNDUP(npages * sizeof(struct coremap_entry), PAGE_SIZE);
+	KASSERT(lo + size < hi);
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(lo);
+	coremap_base = lo + size;
+	coremap_npages = (hi - coremap_base) / PAGE_SIZE;
+	for (i=0; i<coremap_npages; i++) {
+		coremap[i].cme_used = 0;
+		coremap[i].cme_free = 0;
+		coremap[i].cme_order = 0;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_next = coremap[i].cme_prev = -1;
+	}
+	for (i=0; i<BUDDY_NORDERS; i++) {
+		buddy_lists[i] = -1;
+	}
+	coremap_nfree = 0;
+	buddy_free_range(0, coremap_npages);
+	spinlock_release(&coremap_lock);
+
+	kprintf("vm: %u pages of %uk managed\n", coremap_npages,
+		PAGE_SIZE / 1024);
+
+	vmstats_init();
+}
+
+/*
+ * Get one page through the current cpu's magazine. Returns a frame
+ * number, or -1.
+ */
+static
+int
+magazine_alloc(void)
+{
+	struct vm_magazine *mag;
+	int frame;
+
+	/*
+	 * If we move to another cpu after looking at curcpu, we just
+	 * use the other cpu's magazine this once, which is harmless.
+	 */
+	mag = &magazines[curcpu->c_number];
+	spinlock_acquire(&mag->vm_lock);
+	if (mag->vm_count == 0) {
+		spinlock_acquire(&coremap_lock);
+		while (mag->vm_count < VM_MAGAZINE_BATCH) {
+			frame = buddy_alloc(1);
+			if (frame < 0) {
+				break;
+			}
+			mag->vm_frames[mag->vm_count++] = frame;
+		}
+		spinlock_release(&coremap_lock);
+	}
+	frame = -1;
+	if (mag->vm_count > 0) {
+		frame = mag->vm_frames[--mag->vm_count];
+	}
+	spinlock_release(&mag->vm_lock);
+	return frame;
+}
+
+static
+void
+magazine_free(unsigned frame)
+{
+	struct vm_magazine *mag;
+	unsigned i;
+
+	mag = &magazines[curcpu->c_number];
+	spinlock_acquire(&mag->vm_lock);
+	if (mag->vm_count == VM_MAGAZINE_SIZE) {
+		/* Full; send the coldest pages home. */
+		spinlock_acquire(&coremap_lock);
+		for (i=0; i<VM_MAGAZINE_BATCH; i++) {
+			buddy_release(mag->vm_frames[i]);
+		}
+		spinlock_release(&coremap_lock);
+		for (i=VM_MAGAZINE_BATCH; i<VM_MAGAZINE_SIZE; i++) {
+			mag->vm_frames[i - VM_MAGAZINE_BATCH] =
+				mag->vm_frames[i];
+		}
+		mag->vm_count -= VM_MAGAZINE_BATCH;
+	}
+	mag->vm_frames[mag->vm_count++] = frame;
+	spinlock_release(&mag->vm_lock);
 }
 
 static
@@ -64,13 +402,72 @@ paddr_t
 getppages(unsigned long npages)
 {
 	paddr_t addr;
+	int frame;
+
+	spinlock_acquire(&coremap_lock);
+	if (coremap == NULL) {
+		/* Too early; take it for good. */
+		addr = ram_stealmem(npages);
+		spinlock_release(&coremap_lock);
+		return addr;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (npages == 0 || npages > (1U << (BUDDY_NORDERS - 1))) {
+		return 0;
+	}
+
+	if (npages == 1) {
+		frame = magazine_alloc();
+	}
+	else {
+		spinlock_acquire(&coremap_lock);
+		frame = buddy_alloc(npages);
+		spinlock_release(&coremap_lock);
+	}
 
-	spinlock_acquire(&stealmem_lock);
+	if (frame < 0) {
+		/* Maybe the memory is sitting in magazines. */
+		magazine_drain_all();
+		spinlock_acquire(&coremap_lock);
+		frame = buddy_alloc(npages);
+		spinlock_release(&coremap_lock);
+		if (frame < 0) {
+			return 0;
+		}
+	}
+
+	return coremap_base + frame * PAGE_SIZE;
+}
+
+/*
+ * Give back a run of frames from getppages.
+ */
+static
+void
+freeppages(paddr_t addr)
+{
+	unsigned frame;
+
+	KASSERT((addr & PAGE_FRAME) == addr);
+
+	if (coremap == NULL || addr < coremap_base) {
+		/* From ram_stealmem; there's nowhere to put it back. */
+		return;
+	}
+
+	frame = (addr - coremap_base) / PAGE_SIZE;
+	KASSERT(frame < coremap_npages);
+
+	/* The run is ours, so its length can't change under us. */
+	if (coremap[frame].cme_npages == 1) {
+		magazine_free(frame);
+		return;
+	}
 
-	addr = ram_stealmem(npages);
-	
-	spinlock_release(&stealmem_lock);
-	return addr;
+	spinlock_acquire(&coremap_lock);
+	buddy_release(frame);
+	spinlock_release(&coremap_lock);
 }
 
 /* Allocate/free some kernel-space virtual pages */
@@ -88,9 +485,98 @@ alloc_kpages(int npages)
 void 
 free_kpages(vaddr_t addr)
 {
-	/* nothing - leak the memory. */
+	KASSERT(addr >= MIPS_KSEG0);
+	freeppages(addr - MIPS_KSEG0);
+}
+
+unsigned
+vm_freepages(void)
+{
+	unsigned i, total;
+
+	/* Unlocked; it's only a snapshot anyway. */
+	total = coremap_nfree;
+	for (i=0; i<MAXCPUS; i++) {
+		total += magazines[i].vm_count;
+	}
+	return total;
+}
+
+/*
+ * TLB address space IDs.
+ *
+ * Rather than flushing the TLB on every address space switch, each
+ * entry is tagged with an address space ID (the MIPS PID field), so
+ * entries from several address spaces can sit in the TLB at once and
+ * a process that gets the cpu back finds its translations still
+ * there. IDs are handed out per cpu, round-robin, from 1 up; 0 is
+ * left for the invalid entries written by the flush. When a cpu runs
+ * out, it flushes its TLB and starts a new generation, and every
+ * address space has to get a new ID the next time it runs there.
+ *
+ * An address space's ID on a cpu is only good if the generation it
+ * was handed out in is still the cpu's current one. as_create zeroes
+ * the generations, and generations start at 1, so a new address
+ * space never inherits an ID (or stale entries) from a dead one,
+ * even if it was allocated at the same address. IDs of destroyed
+ * address spaces aren't reused until the next flush, so their
+ * leftover entries are never matched.
+ *
+ * All of this is per cpu and only touched at splhigh on that cpu, so
+ * it needs no lock.
+ */
+
+struct vm_asidstate {
+	unsigned va_gen;		/* current generation */
+	unsigned va_next;		/* next ID to hand out */
+	struct addrspace *va_last;	/* whose ID entryhi holds */
+};
+
+static struct vm_asidstate asidstates[MAXCPUS];
+
+/*
+ * Flush this cpu's whole TLB. Call at splhigh.
+ */
+static
+void
+tlb_flush(void)
+{
+	int i;
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+}
+
+/*
+ * Make sure AS has a current ID on this cpu. Call at splhigh.
+ */
+static
+unsigned
+asid_get(struct addrspace *as)
+{
+	unsigned c = curcpu->c_number;
+	struct vm_asidstate *va = &asidstates[c];
 
-	(void)addr;
+	if (va->va_gen == 0) {
+		/* First time on this cpu */
+		va->va_gen = 1;
+		va->va_next = 1;
+	}
+	if (as->as_asidgen[c] != va->va_gen) {
+		if (va->va_next == NUM_TLBPID) {
+			tlb_flush();
+			vmstats_inc(VMSTAT_TLB_INVALIDATE);
+			va->va_gen++;
+			if (va->va_gen == 0) {
+				va->va_gen = 1;
+			}
+			va->va_next = 1;
+		}
+		as->as_asid[c] = va->va_next++;
+		as->as_asidgen[c] = va->va_gen;
+	}
+	return as->as_asid[c];
 }
 
 void
@@ -106,13 +592,136 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+/*
+ * Page tables.
+ *
+ * Each address space has a two-level page table. The top 10 bits of
+ * a virtual address index the directory (as_pagetable), which points
+ * to second-level tables of one page each; the next 10 bits index
+ * that. A page table entry is the physical address of the page with
+ * PTE_VALID set, or 0 if the page hasn't been touched yet. Second-
+ * level tables are only made when something in their 4M of address
+ * space is touched, so a sparse address space costs little.
+ *
+ * Nothing is allocated up front: vm_fault gives a page in a defined
+ * region a zero-filled frame the first time it's touched.
+ *
+ * Address spaces have a single thread, so the page table isn't
+ * locked.
+ */
+#define PT_L1_SHIFT	22
+#define PT_L2_SHIFT	12
+#define PT_L1_ENTRIES	(USERSPACETOP >> PT_L1_SHIFT)
+#define PT_L2_ENTRIES	(PAGE_SIZE / sizeof(uint32_t))
+#define PT_L1_INDEX(va)	((va) >> PT_L1_SHIFT)
+#define PT_L2_INDEX(va)	(((va) >> PT_L2_SHIFT) & (PT_L2_ENTRIES - 1))
+
+#define PTE_VALID	0x1
+#define PTE_PADDR(pte)	((pte) & PAGE_FRAME)
+
+/*
+ * Find the page table entry for VADDR. If its second-level table
+ * doesn't exist, make it if CREATE is set and otherwise return NULL.
+ * Also returns NULL if it can't allocate the table.
+ */
+static
+uint32_t *
+pt_lookup(struct addrspace *as, vaddr_t vaddr, bool create)
+{
+	uint32_t *l2;
+	vaddr_t page;
+
+	KASSERT(vaddr < USERSPACETOP);
+
+	l2 = as->as_pagetable[PT_L1_INDEX(vaddr)];
+	if (l2 == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		page = alloc_kpages(1);
+		if (page == 0) {
+			return NULL;
+		}
+		l2 = (uint32_t *)page;
+		bzero(l2, PAGE_SIZE);
+		as->as_pagetable[PT_L1_INDEX(vaddr)] = l2;
+	}
+	return &l2[PT_L2_INDEX(vaddr)];
+}
+
+/*
+ * Is VADDR in one of the address space's regions?
+ */
+static
+bool
+as_valid_address(struct addrspace *as, vaddr_t vaddr)
+{
+	vaddr_t stackbase;
+
+	if (as->as_vbase1 != 0 && vaddr >= as->as_vbase1 &&
+	    vaddr < as->as_vbase1 + as->as_npages1 * PAGE_SIZE) {
+		return true;
+	}
+	if (as->as_vbase2 != 0 && vaddr >= as->as_vbase2 &&
+	    vaddr < as->as_vbase2 + as->as_npages2 * PAGE_SIZE) {
+		return true;
+	}
+	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
+	if (vaddr >= stackbase && vaddr < USERSTACK) {
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Give the empty entry PTE a zero-filled page.
+ */
+static
+int
+pt_fill(uint32_t *pte)
+{
+	paddr_t paddr;
+
+	KASSERT((*pte & PTE_VALID) == 0);
+
+	paddr = getppages(1);
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+	bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+	*pte = paddr | PTE_VALID;
+	return 0;
+}
+
+/*
+ * Make sure VADDR has a page, as if it had been touched, without
+ * going through the TLB. This is for tests, which can't take faults
+ * on an address space nobody is running in.
+ */
+int
+as_touch(struct addrspace *as, vaddr_t vaddr)
+{
+	uint32_t *pte;
+
+	KASSERT(as_valid_address(as, vaddr));
+
+	pte = pt_lookup(as, vaddr & PAGE_FRAME, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+	if (*pte & PTE_VALID) {
+		return 0;
+	}
+	return pt_fill(pte);
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	paddr_t paddr;
 	int i;
-	uint32_t ehi, elo;
+	uint32_t ehi, elo, *pte;
+	unsigned asid;
 	struct addrspace *as;
 	int spl;
 
@@ -150,38 +759,34 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	}
 
 	/* Assert that the address space has been set up properly. */
+	KASSERT(as->as_pagetable != NULL);
 	KASSERT(as->as_vbase1 != 0);
-	KASSERT(as->as_pbase1 != 0);
 	KASSERT(as->as_npages1 != 0);
-	KASSERT(as->as_vbase2 != 0);
-	KASSERT(as->as_pbase2 != 0);
-	KASSERT(as->as_npages2 != 0);
-	KASSERT(as->as_stackpbase != 0);
 	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
 	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
-
-	vbase1 = as->as_vbase1;
-	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vbase2 = as->as_vbase2;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
-	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
 
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		paddr = (faultaddress - vbase1) + as->as_pbase1;
+	if (!as_valid_address(as, faultaddress)) {
+		return EFAULT;
 	}
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		paddr = (faultaddress - vbase2) + as->as_pbase2;
+
+	vmstats_inc(VMSTAT_TLB_FAULT);
+
+	pte = pt_lookup(as, faultaddress, true);
+	if (pte == NULL) {
+		return ENOMEM;
 	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		paddr = (faultaddress - stackbase) + as->as_stackpbase;
+	if (*pte & PTE_VALID) {
+		/* Just not in the TLB. */
+		vmstats_inc(VMSTAT_TLB_RELOAD);
 	}
 	else {
-		return EFAULT;
+		/* First touch: give it a zeroed page. */
+		if (pt_fill(pte)) {
+			return ENOMEM;
+		}
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
 	}
+	paddr = PTE_PADDR(*pte);
 
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
@@ -189,22 +794,41 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
+	/*
+	 * Tag the entry with our address space ID. We got it when we
+	 * were activated; if the TLB was flushed for wraparound since,
+	 * asid_get hands out a new one.
+	 */
+	asid = asid_get(as);
+
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_read(&ehi, &elo, i);
 		if (elo & TLBLO_VALID) {
 			continue;
 		}
-		ehi = faultaddress;
+		ehi = faultaddress | (asid << TLBHI_PIDSHIFT);
 		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
 		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 		tlb_write(ehi, elo, i);
+		/* tlb_read clobbered the PID; tlb_write put ours back. */
+		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
 		splx(spl);
 		return 0;
 	}
 
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
+	/*
+	 * No free slot; evict something. The hardware random register
+	 * picks a slot for us, and never one of the low wired ones.
+	 * Every page is still in the page table, so whatever we throw
+	 * out just gets reloaded from there next time.
+	 */
+	ehi = faultaddress | (asid << TLBHI_PIDSHIFT);
+	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x (replace)\n", faultaddress, paddr);
+	tlb_random(ehi, elo);
+	vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
 	splx(spl);
-	return EFAULT;
+	return 0;
 }
 
 struct addrspace *
@@ -215,13 +839,19 @@ as_create(void)
 		return NULL;
 	}
 
+	as->as_pagetable = kmalloc(PT_L1_ENTRIES * sizeof(uint32_t *));
+	if (as->as_pagetable == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	bzero(as->as_pagetable, PT_L1_ENTRIES * sizeof(uint32_t *));
+
 	as->as_vbase1 = 0;
-	as->as_pbase1 = 0;
 	as->as_npages1 = 0;
 	as->as_vbase2 = 0;
-	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
-	as->as_stackpbase = 0;
+	bzero(as->as_asid, sizeof(as->as_asid));
+	bzero(as->as_asidgen, sizeof(as->as_asidgen));
 
 	return as;
 }
@@ -229,14 +859,31 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
+	uint32_t *l2;
+	unsigned i, j;
+
+	for (i=0; i<PT_L1_ENTRIES; i++) {
+		l2 = as->as_pagetable[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_L2_ENTRIES; j++) {
+			if (l2[j] & PTE_VALID) {
+				freeppages(PTE_PADDR(l2[j]));
+			}
+		}
+		free_kpages((vaddr_t)l2);
+	}
+	kfree(as->as_pagetable);
 	kfree(as);
 }
 
 void
 as_activate(void)
 {
-	int i, spl;
+	int spl;
 	struct addrspace *as;
+	struct vm_asidstate *va;
 
 	as = curproc_getas();
 #ifdef UW
@@ -249,8 +896,18 @@ as_activate(void)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	/*
+	 * No flush: the TLB can keep entries for other address spaces,
+	 * since they're tagged with theirs. Switching back to the one
+	 * that's already loaded (e.g. between threads of one process,
+	 * or to and from a kernel thread) doesn't even need the PID
+	 * reloaded.
+	 */
+	va = &asidstates[curcpu->c_number];
+	if (va->va_last != as ||
+	    as->as_asidgen[curcpu->c_number] != va->va_gen) {
+		tlb_setpid(asid_get(as));
+		va->va_last = as;
 	}
 
 	splx(spl);
@@ -301,39 +958,11 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	return EUNIMP;
 }
 
-static
-void
-as_zero_region(paddr_t paddr, unsigned npages)
-{
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
-}
-
 int
 as_prepare_load(struct addrspace *as)
 {
-	KASSERT(as->as_pbase1 == 0);
-	KASSERT(as->as_pbase2 == 0);
-	KASSERT(as->as_stackpbase == 0);
-
-	as->as_pbase1 = getppages(as->as_npages1);
-	if (as->as_pbase1 == 0) {
-		return ENOMEM;
-	}
-
-	as->as_pbase2 = getppages(as->as_npages2);
-	if (as->as_pbase2 == 0) {
-		return ENOMEM;
-	}
-
-	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
-	if (as->as_stackpbase == 0) {
-		return ENOMEM;
-	}
-	
-	as_zero_region(as->as_pbase1, as->as_npages1);
-	as_zero_region(as->as_pbase2, as->as_npages2);
-	as_zero_region(as->as_stackpbase, DUMBVM_STACKPAGES);
-
+	/* Nothing to do; pages are allocated as they're touched. */
+	(void)as;
 	return 0;
 }
 
@@ -347,7 +976,7 @@ as_complete_load(struct addrspace *as)
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	KASSERT(as->as_stackpbase != 0);
+	(void)as;
 
 	*stackptr = USERSTACK;
 	return 0;
@@ -357,6 +986,10 @@ int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+	uint32_t *oldl2, *newpte;
+	paddr_t paddr;
+	vaddr_t vaddr;
+	unsigned i, j;
 
 	new = as_create();
 	if (new==NULL) {
@@ -368,28 +1001,40 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	new->as_vbase2 = old->as_vbase2;
 	new->as_npages2 = old->as_npages2;
 
-	/* (Mis)use as_prepare_load to allocate some physical memory. */
-	if (as_prepare_load(new)) {
-		as_destroy(new);
-		return ENOMEM;
+	/* Copy the pages that exist; the rest stay zero-fill. */
+	for (i=0; i<PT_L1_ENTRIES; i++) {
+		oldl2 = old->as_pagetable[i];
+		if (oldl2 == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_L2_ENTRIES; j++) {
+			if ((oldl2[j] & PTE_VALID) == 0) {
+				continue;
+			}
+			vaddr = (i << PT_L1_SHIFT) | (j << PT_L2_SHIFT);
+			newpte = pt_lookup(new, vaddr, true);
+			if (newpte == NULL) {
+				as_destroy(new);
+				return ENOMEM;
+			}
+			paddr = getppages(1);
+			if (paddr == 0) {
+				as_destroy(new);
+				return ENOMEM;
+			}
+			memmove((void *)PADDR_TO_KVADDR(paddr),
+				(const void *)PADDR_TO_KVADDR(PTE_PADDR(oldl2[j])),
+				PAGE_SIZE);
+			*newpte = paddr | PTE_VALID;
+		}
 	}
 
-	KASSERT(new->as_pbase1 != 0);
-	KASSERT(new->as_pbase2 != 0);
-	KASSERT(new->as_stackpbase != 0);
-
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
-		old->as_npages1*PAGE_SIZE);
-
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase2),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase2),
-		old->as_npages2*PAGE_SIZE);
-
-	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
-		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
-		DUMBVM_STACKPAGES*PAGE_SIZE);
-	
 	*ret = new;
 	return 0;
 }
+
+void
+vm_shutdown(void)
+{
+	vmstats_print();
+}
@@ -55,7 +55,8 @@
  *
  * The c0_count register increments on every cycle; when the value
  * matches the c0_compare register, the timer interrupt line is
- * asserted. Writing to c0_compare again clears the interrupt.
+ * asserted and c0_count starts over from zero. Writing to c0_compare
+ * again clears the interrupt.
  */
 static
 void
@@ -73,6 +74,31 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Restart the on-chip timer from zero, so it next goes off COUNT
+ * cycles from now regardless of how far along the current period is.
+ */
+static
+void
+mips_timer_restart(uint32_t count)
+{
+	/*
+	 * $9 == c0_count.
+	 */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mtc0 $0, $9;"		/* count = 0 */
+		"mtc0 %0, $11;"		/* compare = count */
+		".set pop"		/* restore assembler mode */
+		:: "r" (count));
+}
+
+/*
+ * Longest hardclock period we can program: c0_count is 32 bits.
+ */
+#define MAX_HARDCLOCK_TICKS  (0xffffffffU / (CPU_FREQUENCY / HZ))
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -242,6 +268,21 @@ mainbus_send_ipi(struct cpu *target)
 	lamebus_assert_ipi(lamebus, target);
 }
 
+/*
+ * Make the current cpu's next hardclock happen NTICKS hardclock
+ * periods from now instead of one. The timer goes back to interrupting
+ * once per period after that next interrupt.
+ */
+void
+mainbus_set_hardclock(unsigned nticks)
+{
+	KASSERT(nticks > 0);
+	if (nticks > MAX_HARDCLOCK_TICKS) {
+		nticks = MAX_HARDCLOCK_TICKS;
+	}
+	mips_timer_restart(nticks * (CPU_FREQUENCY / HZ));
+}
+
 /*
  * Interrupt dispatcher.
  */
@@ -264,8 +305,14 @@ mainbus_interrupt(struct trapframe *tf)
 		lamebus_interrupt(lamebus);
 	}
 	else if (cause & LAMEBUS_IPI_BIT) {
-		interprocessor_interrupt();
+		/*
+		 * Clear first: ipi_send doesn't raise the interrupt
+		 * again for IPIs posted before interprocessor_interrupt
+		 * collects the pending bits, so clearing afterwards
+		 * could lose one posted in between.
+		 */
 		lamebus_clear_ipi(lamebus, curcpu);
+		interprocessor_interrupt();
 	}
 	else if (cause & MIPS_TIMER_BIT) {
 		/* Reset the timer (this clears the interrupt) */
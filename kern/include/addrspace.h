@@ -36,6 +36,7 @@
 
 
 #include <vm.h>
+#include <platform/maxcpus.h>
 
 struct vnode;
 
@@ -48,13 +49,13 @@ struct vnode;
  */
 
 struct addrspace {
+  uint32_t **as_pagetable;      /* two-level page table */
   vaddr_t as_vbase1;
-  paddr_t as_pbase1;
   size_t as_npages1;
   vaddr_t as_vbase2;
-  paddr_t as_pbase2;
   size_t as_npages2;
-  paddr_t as_stackpbase;
+  unsigned as_asid[MAXCPUS];    /* TLB address space ID, per cpu */
+  unsigned as_asidgen[MAXCPUS]; /* ...valid if it matches the cpu's */
 };
 
 /*
@@ -91,6 +92,10 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_touch  - give a page in a defined region memory, as touching
+ *                it would. For tests that don't run in the address
+ *                space.
  */
 
 struct addrspace *as_create(void);
@@ -107,6 +112,7 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_touch(struct addrspace *as, vaddr_t vaddr);
 
 
 /*
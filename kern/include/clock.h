@@ -36,10 +36,11 @@
  * Time-related definitions.
  *
  * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * when the CPU is not idle, for scheduling. A CPU that is idle or has
+ * nothing else to run skips hardclocks (see hardclock_stop).
  *
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timerclock() is called on one CPU once a second. It is only a
+ * backstop; timed sleeps are run from hardclock.
  *
  * gettime() may be used to fetch the current time of day.
  * getinterval() computes the time from time1 to time2.
@@ -56,11 +57,23 @@
 #define HZ  100
 #endif
 
-void hardclock_bootstrap(void);
+/*
+ * Timing constants. These should be tuned along with any work done on
+ * the scheduler.
+ */
+#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
+#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
 void hardclock(void);
 void timerclock(void);
 
+/*
+ * Stop and restart the current cpu's periodic hardclock when it has
+ * nothing to switch to. See clock.c.
+ */
+void hardclock_stop(void);
+void hardclock_start(void);
+
 void gettime(time_t *seconds, uint32_t *nanoseconds);
 
 void getinterval(time_t secs1, uint32_t nsecs,
@@ -69,7 +82,8 @@ void getinterval(time_t secs1, uint32_t nsecs,
 
 /*
  * clocksleep() suspends execution for the requested number of seconds,
- * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
+ * like userlevel sleep(3). (Don't confuse it with wchan_sleep.) For
+ * finer resolution use thread_sleep_until.
  */
 void clocksleep(int seconds);
 
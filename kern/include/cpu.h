@@ -59,16 +59,45 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_threadcache; /* Recycled threads, with stacks */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_nswitch;		/* Counter of context switches */
+	uint64_t c_idletime;		/* Nanoseconds spent idle */
+	unsigned c_nreaped;		/* Counter of zombies reaped */
+	uint64_t c_reaptime;		/* Total ns from exit to reaping */
+	uint64_t c_reapmax;		/* Longest ns from exit to reaping */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
+	bool c_tickless;		/* True if hardclock is stopped */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Accessed by other cpus without locking.
+	 *
+	 * Threads woken from another cpu are pushed onto c_inbox, a
+	 * lock-free stack linked through t_inboxnext, rather than
+	 * straight onto the run queue; this cpu moves them over
+	 * itself. See inbox_push in thread.c.
+	 */
+	volatile spinlock_data_t c_inbox;	/* Remote wakeups */
+
+	/*
+	 * Accessed by other cpus.
+	 * Protected by c_allthreads_lock.
+	 *
+	 * Every live thread is on the list of the cpu it was created
+	 * on, linked through t_allnext, for thread_printstats. It is
+	 * unlinked from whichever cpu reaps it, so the lock is mostly
+	 * but not only taken by this cpu.
+	 */
+	struct thread *c_allthreads;	/* Threads created here */
+	struct spinlock c_allthreads_lock;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -82,8 +111,14 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * An interrupt is only raised when c_ipi_pending goes from
+	 * zero to nonzero; IPIs posted while one is already pending
+	 * are coalesced into it.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
+	unsigned c_ipi_sent;		/* Counter of interrupts raised */
+	unsigned c_ipi_coalesced;	/* Counter of IPIs coalesced */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
 	struct spinlock c_ipi_lock;
@@ -139,6 +174,13 @@ void cpu_irqon(void);
 void cpu_idle(void);
 void cpu_halt(void);
 
+/*
+ * Read the current cpu's cycle counter. This is only good for timing
+ * short intervals with interrupts off; it may be reset by the timer
+ * interrupt and isn't synchronized across cpus.
+ */
+uint32_t cpu_cycles(void);
+
 /*
  * Interprocessor interrupts.
  *
@@ -0,0 +1,93 @@
+/*
+ * Lock contention profiling.
+ */
+
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+/*
+ * With "options lockprof", spinlocks, locks and semaphores keep
+ * counts of how often they're acquired, how often that had to wait,
+ * how long was spent waiting, and (spinlocks and locks) the longest
+ * time one was held. The "lp" menu command prints the most contended.
+ *
+ * Every lock has its own record, embedded in it, and all the records
+ * are on one list so they can be found for printing. Locks and
+ * semaphores are shown by name. Spinlocks don't have names, so they
+ * are shown by address, along with where spinlock_init was called
+ * from; use the kernel's symbol table to match them up.
+ *
+ * A record is only ever updated by whoever holds the lock it's for
+ * (for semaphores, the semaphore's spinlock), with interrupts off,
+ * so updates never race with each other. Each one bumps lp_seq to
+ * odd before and back to even after, so the printer, which takes no
+ * lock, can tell when it has read a record halfway through one.
+ *
+ * Spinlock times, and lock hold times, are in cycles. Lock and
+ * semaphore waits are in nanoseconds, taken from the clock only when
+ * something actually had to wait, and are only collected once the
+ * clock is running.
+ *
+ * The cycle counter is per cpu and starts over at every hardclock, so
+ * a lock hold can only be timed if it starts and ends on the same cpu
+ * between two hardclocks. Longer ones are just counted, as long holds.
+ */
+
+#define LOCKPROF_SPIN	0	/* spinlock */
+#define LOCKPROF_LOCK	1	/* struct lock */
+#define LOCKPROF_SEM	2	/* struct semaphore */
+
+struct lockprof {
+	struct lockprof *lp_next;	/* List of all records */
+	struct lockprof **lp_prevp;
+	uintptr_t lp_listed;		/* Set while on the list; see .c */
+	int lp_kind;			/* LOCKPROF_* */
+	const void *lp_lock;		/* The lock itself */
+	const char *lp_name;		/* Locks and semaphores: name */
+	const void *lp_site;		/* Spinlocks: spinlock_init caller */
+	volatile unsigned lp_seq;	/* Odd while being updated */
+	unsigned lp_acquires;		/* Times acquired */
+	unsigned lp_contended;		/* Times acquisition had to wait */
+	uint64_t lp_wait;		/* Total time spent waiting */
+	uint64_t lp_maxhold;		/* Longest time held */
+	unsigned lp_longholds;		/* Locks: holds too long to time */
+};
+
+/* Call once the clock is available. */
+void lockprof_bootstrap(void);
+
+/*
+ * Set up the record LP for the lock LOCK and put it on the list.
+ * NAME (which must last as long as the lock) is NULL for spinlocks;
+ * SITE is where a spinlock was initialized, or NULL. A record that's
+ * already on the list stays there, with its counts.
+ */
+void lockprof_add(struct lockprof *lp, int kind, const void *lock,
+		  const char *name, const void *site);
+
+/* True if LP is on the list. */
+bool lockprof_listed(const struct lockprof *lp);
+
+/* Take LP off the list, before the lock goes away. */
+void lockprof_remove(struct lockprof *lp);
+
+/*
+ * Record one acquisition, and if CONTENDED, WAIT time units spent
+ * waiting for it. Call holding the lock with interrupts off.
+ */
+void lockprof_acquired(struct lockprof *lp, bool contended, uint64_t wait);
+
+/* Record a hold time, keeping the maximum. Likewise. */
+void lockprof_hold(struct lockprof *lp, uint64_t held);
+
+/* Record a hold that couldn't be timed. Likewise. */
+void lockprof_longhold(struct lockprof *lp);
+
+/* Time in nanoseconds for lock and semaphore waits, or 0. */
+uint64_t lockprof_now(void);
+
+/* Print the MAX most contended records. */
+void lockprof_printstats(unsigned max);
+
+
+#endif /* _LOCKPROF_H_ */
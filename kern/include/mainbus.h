@@ -55,6 +55,9 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/* Delay the current cpu's next hardclock by NTICKS periods. */
+void mainbus_set_hardclock(unsigned nticks);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
@@ -77,6 +77,9 @@ extern struct proc *kproc;
 /* Semaphore used to signal when there are no more processes */
 #ifdef UW
 extern struct semaphore *no_proc_sem;
+
+/* Number of processes, not counting kproc. */
+unsigned proc_getcount(void);
 #endif // UW
 
 /* Call once during system startup to allocate data structures. */
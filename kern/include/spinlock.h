@@ -36,6 +36,11 @@
  */
 
 #include <cdefs.h>
+#include "opt-ticketlock.h"
+#include "opt-lockprof.h"
+#if OPT_LOCKPROF
+#include <lockprof.h>
+#endif
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -53,16 +58,31 @@
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
+ *
+ * With the "ticketlock" kernel option, spinlocks are ticket locks:
+ * lk_lock is the next ticket to hand out and lk_serving the ticket
+ * allowed in. CPUs get the lock in the order they asked for it, and
+ * each waiter only spins on lk_serving. Without it they are
+ * test-and-test-and-set locks with exponential backoff.
  */
 struct spinlock {
 	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
+#if OPT_TICKETLOCK
+	volatile spinlock_data_t lk_serving; /* Ticket now being served. */
+#endif
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+#if OPT_LOCKPROF
+	struct lockprof lk_prof;	/* Profiling record */
+	uint32_t lk_acqtime;		/* Cycle count when acquired */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
+ * (Fields not named are zero.)
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER	{ .lk_lock = SPINLOCK_DATA_INITIALIZER, \
+				  .lk_holder = NULL }
 
 /*
  * Spinlock functions.
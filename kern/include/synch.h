@@ -36,6 +36,7 @@
 
 
 #include <spinlock.h>
+#include "opt-lockprof.h"
 
 /*
  * Dijkstra-style semaphore.
@@ -48,11 +49,25 @@ struct semaphore {
 	struct wchan *sem_wchan;
 	struct spinlock sem_lock;
         volatile int sem_count;
+	bool sem_handoff;		/* V hands the count to a sleeper */
+	unsigned sem_waiters;		/* sleepers, in handoff mode */
+#if OPT_LOCKPROF
+	struct lockprof sem_prof;	/* Updated under sem_lock */
+#endif
 };
 
 struct semaphore *sem_create(const char *name, int initial_count);
 void sem_destroy(struct semaphore *);
 
+/*
+ * sem_create_fifo makes a semaphore in direct-handoff mode: when
+ * threads are sleeping in P, V does not bump the count but passes
+ * it straight to the thread it wakes, and P does not take a free
+ * count while anyone is queued. Waiters therefore get through in
+ * strict FIFO order and cannot be barged past by newcomers.
+ */
+struct semaphore *sem_create_fifo(const char *name, int initial_count);
+
 /*
  * Operations (both atomic):
  *     P (proberen): decrement count. If the count is 0, block until
@@ -74,8 +89,17 @@ void V(struct semaphore *);
  */
 struct lock {
         char *lk_name;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
+        struct wchan *lk_wchan;
+        struct spinlock lk_lock;
+        struct thread *volatile lk_owner;	/* NULL if not held */
+        struct lock *lk_nextheld;	/* Next in owner's t_heldlocks */
+        unsigned lk_waiters;		/* Threads with t_blockedon == it */
+#if OPT_LOCKPROF
+        struct lockprof lk_prof;	/* Updated under lk_lock */
+        uint32_t lk_acqtime;		/* Cycle count when acquired, */
+        struct cpu *lk_acqcpu;		/* on this cpu, */
+        unsigned lk_acqclock;		/* at this hardclock */
+#endif
 };
 
 struct lock *lock_create(const char *name);
@@ -90,7 +114,16 @@ void lock_acquire(struct lock *);
  *    lock_do_i_hold - Return true if the current thread holds the lock; 
  *                   false otherwise.
  *
- * These operations must be atomic. You get to write them.
+ * These operations must be atomic.
+ *
+ * lock_acquire is adaptive: if the lock is held by a thread that is
+ * running on another cpu, it's likely to be released soon, so we spin
+ * for a while before going to sleep. This avoids two context switches
+ * for short critical sections.
+ *
+ * Locks do priority inheritance: a thread sleeping on a lock lends
+ * its scheduling priority to the owner (and on down the chain, if the
+ * owner is itself waiting for a lock) until the lock is released.
  */
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
@@ -113,8 +146,7 @@ void lock_destroy(struct lock *);
 
 struct cv {
         char *cv_name;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
+        struct wchan *cv_wchan;
 };
 
 struct cv *cv_create(const char *name);
@@ -131,11 +163,64 @@ void cv_destroy(struct cv *);
  * in. Note that under normal circumstances the same lock should be used
  * on all operations with any particular CV.
  *
- * These operations must be atomic. You get to write them.
+ * cv_broadcast doesn't actually make the sleepers runnable; since
+ * they would only block again on the lock, which the caller holds, it
+ * moves them straight onto the lock's queue instead ("wait
+ * morphing"). They then come out one at a time as the lock is
+ * released.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers, or a single writer, may hold the lock at
+ * once. Writers are preferred: once a writer is waiting, new readers
+ * wait behind it. (So a thread that already holds a read lock must
+ * not try to get another; it can deadlock against a waiting writer.)
+ *
+ * The internal structure is only exposed to allow the compiler to
+ * do inline allocation; don't touch it from outside.
+ */
+struct rwlock {
+	char *rw_name;
+	struct spinlock rw_lock;
+	struct wchan *rw_readwchan;	/* Readers wait here */
+	struct wchan *rw_writewchan;	/* Writers and upgraders wait here */
+	unsigned rw_readers;		/* Number of readers holding it */
+	unsigned rw_writerswaiting;	/* Number of writers waiting */
+	struct thread *rw_writer;	/* Writer holding it, or NULL */
+	struct thread *rw_upgrader;	/* Reader waiting to upgrade */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading.
+ *    rwlock_release_read  - Release a read lock.
+ *    rwlock_acquire_write - Get the lock for writing.
+ *    rwlock_release_write - Release a write lock.
+ *    rwlock_upgrade       - Turn a read lock into a write lock, waiting
+ *                           for the other readers to leave. Only one
+ *                           thread may be upgrading a given lock at a
+ *                           time; callers must arrange that themselves.
+ *    rwlock_downgrade     - Turn a write lock into a read lock without
+ *                           letting any other writer in between.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock for writing.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+void rwlock_upgrade(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -50,6 +50,11 @@ void enter_forked_process(struct trapframe *tf);
 void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 		       vaddr_t entrypoint);
 
+#ifdef UW
+/* Set up the futex hash table. */
+void futex_bootstrap(void);
+#endif // UW
+
 
 /*
  * Prototypes for IN-KERNEL entry points for system call implementations.
@@ -63,6 +68,8 @@ int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
 void sys__exit(int exitcode);
 int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
+int sys_futex_wait(userptr_t uaddr, int expected);
+int sys_futex_wake(userptr_t uaddr, int count, int *retval);
 
 #endif // UW
 
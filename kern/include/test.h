@@ -59,6 +59,11 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int spinlocktest(int, char **);
+
+/* vm tests */
+int vmstresstest(int, char **);
+int vmbenchtest(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
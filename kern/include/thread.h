@@ -36,11 +36,13 @@
  * Note: curthread is defined by <current.h>.
  */
 
+#include <kern/time.h>
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
 
 struct cpu;
+struct lock;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -56,6 +58,12 @@ struct cpu;
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
 
+/* t_inherited value meaning no priority has been inherited. */
+#define THREAD_NO_INHERIT 0x7fffffff
+
+/* Names shorter than this are stored in the thread itself. */
+#define THREAD_NAME_INLINE 16
+
 /* States a thread can be in. */
 typedef enum {
 	S_RUN,		/* running */
@@ -73,17 +81,79 @@ struct thread {
 	char *t_name;			/* Name of this thread */
 	const char *t_wchan_name;	/* Name of wait channel, if sleeping */
 	threadstate_t t_state;		/* State this thread is in */
+	char t_namebuf[THREAD_NAME_INLINE]; /* Storage for short names */
 
 	/*
 	 * Thread subsystem internal fields.
 	 */
 	struct thread_machdep t_machdep; /* Any machine-dependent goo */
 	struct threadlistnode t_listnode; /* Link for run/sleep/zombie lists */
+	struct thread *t_inboxnext;	/* Link for cpu wakeup inbox */
+	struct cpu *t_allcpu;		/* Whose c_allthreads we're on */
+	struct thread *t_allnext;	/* Next on that list */
+	struct thread **t_allprevp;	/* Whatever points to us there */
 	void *t_stack;			/* Kernel-level stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
 
+	/*
+	 * Scheduler fields.
+	 *
+	 * t_priority is the thread's feedback queue level; 0 is the
+	 * highest priority. Run queues are kept sorted by it.
+	 * t_ticks counts the hardclocks used of the current time
+	 * slice and t_waitticks the hardclocks spent waiting on a run
+	 * queue since the thread last ran.
+	 *
+	 * These are protected by the run queue lock of t_cpu while
+	 * the thread is on a run queue, and otherwise belong to the
+	 * thread itself.
+	 */
+	int t_priority;			/* Scheduling priority level */
+	unsigned t_ticks;		/* Hardclocks used in time slice */
+	unsigned t_waitticks;		/* Hardclocks waited to run */
+
+	/*
+	 * Priority inheritance (see synch.c). t_inherited is the best
+	 * priority donated by threads waiting on locks this thread
+	 * holds; the thread is scheduled at the better of it and
+	 * t_priority. t_blockedon is the lock the thread is sleeping
+	 * on, if any, and t_heldlocks the locks it holds, linked
+	 * through lk_nextheld.
+	 *
+	 * t_inherited and t_blockedon are protected by the priority
+	 * inheritance spinlock in synch.c; t_heldlocks belongs to the
+	 * thread itself.
+	 */
+	int t_inherited;		/* Inherited priority level */
+	struct lock *t_blockedon;	/* Lock being waited for */
+	struct lock *t_heldlocks;	/* List of locks held */
+
+	/*
+	 * Cache affinity. t_lastcpu is the cpu the thread last ran
+	 * on (NULL if it has never run) and t_lastrun is the value of
+	 * that cpu's c_hardclocks when it stopped running there.
+	 * Set in thread_switch; used to decide what to migrate.
+	 */
+	struct cpu *t_lastcpu;		/* CPU thread last ran on */
+	unsigned t_lastrun;		/* When it last ran there */
+
+	/* Time to wake up, while in thread_sleep_until */
+	struct timespec t_wakeup;
+
+	/*
+	 * Accounting, maintained by thread_switch. Times are in
+	 * nanoseconds. t_stamp is when the thread last started
+	 * running, or last became ready to run if it's not running,
+	 * or exited if it's a zombie.
+	 */
+	uint64_t t_stamp;		/* Time of last state change */
+	uint64_t t_runtime;		/* Total time spent running */
+	uint64_t t_waittime;		/* Total time spent ready to run */
+	unsigned t_nvswitch;		/* Voluntary context switches */
+	unsigned t_nivswitch;		/* Involuntary context switches */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -144,6 +214,29 @@ int thread_fork(const char *name, struct proc *proc,
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2);
 
+/*
+ * Like thread_fork, but the new thread is in the real-time class
+ * with fixed priority "rtpriority", 0 being the highest and
+ * THREAD_RT_NPRIO-1 the lowest. Real-time threads always run before
+ * normal threads and are never demoted. A real-time thread keeps the
+ * cpu until it blocks or yields, or a higher-priority real-time
+ * thread becomes runnable, so they should be used only for short,
+ * latency-critical work.
+ */
+#define THREAD_RT_NPRIO 4
+int thread_fork_rt(const char *name, struct proc *proc, int rtpriority,
+                   void (*func)(void *, unsigned long),
+                   void *data1, unsigned long data2);
+
+/*
+ * Move the current thread into the real-time class at "rtpriority",
+ * or with THREAD_RT_NONE back into the normal class, at its top
+ * level. For threads that are only latency-critical some of the
+ * time, such as while waiting for input.
+ */
+#define THREAD_RT_NONE (-1)
+int thread_set_rtpriority(int rtpriority);
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
@@ -157,16 +250,74 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Sleep until the time of day (as returned by gettime) reaches
+ * WAKEUP. Sleeping threads are woken by thread_timed_wakeup, which
+ * runs on every hardclock, so the wakeup is accurate to a hardclock.
+ * Interrupts need not be disabled.
+ */
+void thread_sleep_until(const struct timespec *wakeup);
+
+/*
+ * Wake up every thread whose thread_sleep_until time has arrived.
+ * Called from the timer interrupt.
+ */
+void thread_timed_wakeup(void);
+
+/*
+ * Get the earliest thread_sleep_until wakeup time of any sleeping
+ * thread. Returns false if no thread is in a timed sleep.
+ */
+bool thread_next_wakeup(struct timespec *ret);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
+/*
+ * Charge the current thread for one hardclock and preempt it if its
+ * time slice has run out or a higher-priority thread is waiting.
+ * Called from the timer interrupt.
+ */
+void thread_timeslice(void);
+
+/*
+ * Move threads woken by other cpus onto the current cpu's run queue.
+ * Returns true if there were any. Call with interrupts off and the
+ * current cpu's run queue lock held.
+ */
+bool thread_inbox_drain(void);
+
+/*
+ * Wake one idle cpu, if there is one, so it tries stealing work.
+ * Called when the current cpu has threads waiting to run; does
+ * nothing unless one of them is allowed to migrate.
+ */
+void thread_kick_idle(void);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
  */
 void thread_consider_migration(void);
 
+/*
+ * Effective scheduling priority of a thread: the better (lower) of its
+ * own and any it has inherited.
+ */
+int thread_priority(const struct thread *t);
+
+/*
+ * Set the priority a thread has inherited through locks it holds
+ * (THREAD_NO_INHERIT for none), moving it on its run queue if needed.
+ */
+void thread_inherit_priority(struct thread *t, int priority);
+
+/*
+ * Print per-cpu and per-thread time and context switch statistics.
+ */
+void thread_printstats(void);
+
 
 #endif /* _THREAD_H_ */
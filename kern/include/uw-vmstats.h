@@ -38,6 +38,9 @@
 #define VMSTAT_SWAP_FILE_WRITE        (9)
 #define VMSTAT_COUNT                 (10)
 
+/* Room for stats added with vmstats_register */
+#define VMSTAT_MAX                   (32)
+
 /* ----------------------------------------------------------------------- */
 
 /* Initialize the statistics: must be called before using */
@@ -52,7 +55,19 @@ void _vmstats_init(void);                    /* atomicity must be ensured elsewh
 void vmstats_inc(unsigned int index);    /* uses locking */
 void _vmstats_inc(unsigned int index);   /* atomicity must be ensured elsewhere */
 
+/* Add a stat beyond the fixed ones, while bootstrapping. NAME is
+ * printed by vmstats_print and must not be freed. Returns the index
+ * to pass to vmstats_inc, or -1 if there's no room left.
+ */
+int vmstats_register(const char *name);     /* uses locking */
+
+/* Add up the counts from every cpu into TOTALS, which must have room
+ * for VMSTAT_MAX entries, and return how many stats there are. Each
+ * cpu's counts are read consistently.
+ */
+unsigned vmstats_snapshot(unsigned int *totals); /* uses locking */
+
 /* Print the statistics: assumes that at least vmstats_init has been called */
-void vmstats_print(void);                    /* Does NOT use locking */
+void vmstats_print(void);                    /* Does NOT need locking */
 
 #endif /* VM_STATS_H */
@@ -120,6 +120,9 @@ int vfs_getcwd(struct uio *buf);
  *    vfs_bootstrap - Call during system initialization to allocate 
  *                    structures.
  *
+ *    vfs_bootfs_bootstrap - Called by vfs_bootstrap to set up the
+ *                    bootfs state.
+ *
  *    vfs_setbootfs - Set the filesystem that paths beginning with a
  *                    slash are sent to. If not set, these paths fail
  *                    with ENOENT. The argument should be the device
@@ -160,6 +163,7 @@ int vfs_getcwd(struct uio *buf);
  */
 
 void vfs_bootstrap(void);
+void vfs_bootfs_bootstrap(void);
 
 int vfs_setbootfs(const char *fsname);
 void vfs_clearbootfs(void);
@@ -55,6 +55,12 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/* Number of free physical pages, for tests and statistics */
+unsigned vm_freepages(void);
+
+/* Called at shutdown; prints statistics */
+void vm_shutdown(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
@@ -36,6 +36,7 @@
 
 
 struct wchan; /* Opaque */
+struct lock;  /* for wchan_requeue */
 
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
@@ -55,6 +56,13 @@ void wchan_destroy(struct wchan *wc);
  */
 bool wchan_isempty(struct wchan *wc);
 
+/*
+ * Return the best effective scheduling priority (see thread.h) of the
+ * threads sleeping on the channel, or THREAD_NO_INHERIT if there are
+ * none. Used for priority inheritance.
+ */
+int wchan_best_priority(struct wchan *wc);
+
 /*
  * Lock and unlock the wait channel.
  */
@@ -81,5 +89,16 @@ void wchan_sleep(struct wchan *wc);
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Move all threads sleeping on WC to the end of TO's queue without
+ * waking them. Neither channel should already be locked. Each thread
+ * moved has its t_blockedon set to BLOCKEDON; the caller must hold
+ * the priority inheritance lock. Returns the number of threads moved
+ * and puts the best effective priority among them, as for
+ * wchan_best_priority, in *BEST.
+ */
+unsigned wchan_requeue(struct wchan *wc, struct wchan *to,
+		       struct lock *blockedon, int *best);
+
 
 #endif /* _WCHAN_H_ */
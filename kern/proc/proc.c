@@ -210,6 +210,23 @@ proc_bootstrap(void)
 #endif // UW 
 }
 
+#ifdef UW
+/*
+ * Number of processes, excluding kproc. It can change as soon as
+ * it's returned, unless the caller knows nobody is making new ones.
+ */
+unsigned
+proc_getcount(void)
+{
+	unsigned count;
+
+	P(proc_count_mutex);
+	count = proc_count;
+	V(proc_count_mutex);
+	return count;
+}
+#endif // UW
+
 /*
  * Create a fresh proc for use by runprogram.
  *
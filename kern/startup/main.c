@@ -49,7 +49,9 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <lockprof.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-lockprof.h"
 
 
 /*
@@ -109,7 +111,6 @@ boot(void)
 	ram_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
-	hardclock_bootstrap();
 	vfs_bootstrap();
 
 	/* Probe and initialize devices. Interrupts should come on. */
@@ -120,10 +121,17 @@ boot(void)
 	/* Now do pseudo-devices. */
 	pseudoconfig();
 	kprintf("\n");
+#if OPT_LOCKPROF
+	/* The clock is attached now, so lock waits can be timed. */
+	lockprof_bootstrap();
+#endif
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
 	kprintf_bootstrap();
+#ifdef UW
+	futex_bootstrap();
+#endif
 	thread_start_cpus();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
@@ -151,6 +159,8 @@ shutdown(void)
 	vfs_clearcurdir();
 	vfs_unmountall();
 
+	vm_shutdown();
+
 	thread_shutdown();
 
 	splhigh();
@@ -42,9 +42,11 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <lockprof.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockprof.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -54,6 +56,9 @@
 
 #define MAXMENUARGS  16
 
+/* Real-time priority of the menu thread while reading a command */
+#define MENU_RTPRIORITY  0
+
 // XXX this should not be in this file
 void
 getinterval(time_t s1, uint32_t ns1, time_t s2, uint32_t ns2,
@@ -396,6 +401,45 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_LOCKPROF
+/*
+ * Command for printing the most contended locks.
+ */
+static
+int
+cmd_lockprof(int nargs, char **args)
+{
+	unsigned max = 20;
+
+	if (nargs > 2) {
+		kprintf("Usage: lp [count]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		max = atoi(args[1]);
+	}
+
+	lockprof_printstats(max);
+
+	return 0;
+}
+#endif
+
+/*
+ * Command for printing thread and cpu time statistics.
+ */
+static
+int
+cmd_top(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -465,6 +509,9 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sl1] Spinlock benchmark            ",
+	"[vm1] VM stress test                ",
+	"[vm2] Page allocator benchmark      ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -504,6 +551,10 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[top] Thread time stats             ",
+#if OPT_LOCKPROF
+	"[lp] Lock contention stats          ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -559,6 +610,10 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "top",        cmd_top },
+#if OPT_LOCKPROF
+	{ "lp",         cmd_lockprof },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -576,6 +631,11 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sl1",	spinlocktest },
+
+	/* vm tests */
+	{ "vm1",	vmstresstest },
+	{ "vm2",	vmbenchtest },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -705,7 +765,15 @@ menu(char *args)
 
 	while (1) {
 		kprintf("OS/161 kernel [? for menu]: ");
+		/*
+		 * Read the command line as a real-time thread, so the
+		 * console keeps echoing promptly however busy the system
+		 * is. Run the command as a normal thread, so a long one
+		 * can't starve everything else on this cpu.
+		 */
+		thread_set_rtpriority(MENU_RTPRIORITY);
 		kgets(buf, sizeof(buf));
+		thread_set_rtpriority(THREAD_RT_NONE);
 		menu_execute(buf, 0);
 	}
 }
@@ -0,0 +1,224 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <wchan.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/*
+ * Futexes: kernel-assisted wait and wake for user-level
+ * synchronization.
+ *
+ * A user-level mutex or condition variable keeps its state in an
+ * ordinary int and only enters the kernel when it has to block or
+ * when there might be someone to wake. futex_wait(addr, expected)
+ * sleeps only if *addr still holds EXPECTED; futex_wake(addr, n)
+ * wakes up to N threads sleeping on ADDR and returns how many it
+ * woke.
+ *
+ * Sleepers are kept in a hash table keyed on (address space, user
+ * address). Each key that currently has sleepers gets a struct futex
+ * with its own wchan, so a wake never disturbs threads waiting on
+ * something else that hashes to the same bucket. The struct futex is
+ * made by the first sleeper and freed by the wake that takes the
+ * last one off.
+ *
+ * Each bucket is protected by a sleep lock rather than a spinlock,
+ * because futex_wait has to read the user's word while holding it
+ * (otherwise a wake could come between the check and the sleep) and
+ * copyin can fault. A waiter locks the wchan before letting go of
+ * the bucket lock, as in P(), so the wake can't be missed.
+ */
+
+#define FUTEX_NBUCKETS	64
+
+struct futex {
+	struct addrspace *f_as;
+	vaddr_t f_addr;
+	struct wchan *f_wchan;
+	unsigned f_waiters;		/* threads asleep on f_wchan */
+	struct futex *f_next;		/* next in bucket */
+};
+
+struct futexbucket {
+	struct lock *fb_lock;
+	struct futex *fb_futexes;
+};
+
+static struct futexbucket futextable[FUTEX_NBUCKETS];
+
+void
+futex_bootstrap(void)
+{
+	char name[16];
+	unsigned i;
+
+	for (i=0; i<FUTEX_NBUCKETS; i++) {
+		snprintf(name, sizeof(name), "futex%u", i);
+		futextable[i].fb_lock = lock_create(name);
+		if (futextable[i].fb_lock == NULL) {
+			panic("futex_bootstrap: Out of memory\n");
+		}
+		futextable[i].fb_futexes = NULL;
+	}
+}
+
+static
+struct futexbucket *
+futex_bucket(struct addrspace *as, vaddr_t addr)
+{
+	unsigned h;
+
+	h = (unsigned)(uintptr_t)as / sizeof(void *) + addr / sizeof(int);
+	return &futextable[h % FUTEX_NBUCKETS];
+}
+
+/*
+ * Find the futex for AS and ADDR in bucket FB, or NULL. The bucket
+ * lock must be held.
+ */
+static
+struct futex *
+futex_lookup(struct futexbucket *fb, struct addrspace *as, vaddr_t addr)
+{
+	struct futex *f;
+
+	KASSERT(lock_do_i_hold(fb->fb_lock));
+
+	for (f = fb->fb_futexes; f != NULL; f = f->f_next) {
+		if (f->f_as == as && f->f_addr == addr) {
+			return f;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Get the user address as a key. Must be word-aligned, so it can't
+ * straddle a page.
+ */
+static
+int
+futex_key(userptr_t uaddr, struct addrspace **as_ret, vaddr_t *addr_ret)
+{
+	vaddr_t addr;
+
+	addr = (vaddr_t)uaddr;
+	if (addr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+	*as_ret = curproc_getas();
+	*addr_ret = addr;
+	return 0;
+}
+
+int
+sys_futex_wait(userptr_t uaddr, int expected)
+{
+	struct addrspace *as;
+	vaddr_t addr;
+	struct futexbucket *fb;
+	struct futex *f;
+	int val, result;
+
+	result = futex_key(uaddr, &as, &addr);
+	if (result) {
+		return result;
+	}
+	fb = futex_bucket(as, addr);
+
+	lock_acquire(fb->fb_lock);
+	result = copyin((const_userptr_t)uaddr, &val, sizeof(val));
+	if (result) {
+		lock_release(fb->fb_lock);
+		return result;
+	}
+	if (val != expected) {
+		/* Changed already; whatever we were waiting for happened. */
+		lock_release(fb->fb_lock);
+		return EAGAIN;
+	}
+
+	f = futex_lookup(fb, as, addr);
+	if (f == NULL) {
+		f = kmalloc(sizeof(*f));
+		if (f == NULL) {
+			lock_release(fb->fb_lock);
+			return ENOMEM;
+		}
+		f->f_wchan = wchan_create("futex");
+		if (f->f_wchan == NULL) {
+			kfree(f);
+			lock_release(fb->fb_lock);
+			return ENOMEM;
+		}
+		f->f_as = as;
+		f->f_addr = addr;
+		f->f_waiters = 0;
+		f->f_next = fb->fb_futexes;
+		fb->fb_futexes = f;
+	}
+
+	/*
+	 * The waker does the bookkeeping, and may free F as soon as
+	 * it has woken us, so don't touch F after sleeping.
+	 */
+	f->f_waiters++;
+	wchan_lock(f->f_wchan);
+	lock_release(fb->fb_lock);
+	wchan_sleep(f->f_wchan);
+
+	return 0;
+}
+
+int
+sys_futex_wake(userptr_t uaddr, int count, int *retval)
+{
+	struct addrspace *as;
+	vaddr_t addr;
+	struct futexbucket *fb;
+	struct futex *f, **fp;
+	int result, woken;
+
+	result = futex_key(uaddr, &as, &addr);
+	if (result) {
+		return result;
+	}
+	if (count < 0) {
+		return EINVAL;
+	}
+	fb = futex_bucket(as, addr);
+
+	woken = 0;
+	lock_acquire(fb->fb_lock);
+	f = futex_lookup(fb, as, addr);
+	if (f != NULL) {
+		while (woken < count && f->f_waiters > 0) {
+			f->f_waiters--;
+			wchan_wakeone(f->f_wchan);
+			woken++;
+		}
+		if (f->f_waiters == 0) {
+			/*
+			 * Everyone counted in f_waiters was on the
+			 * wchan before we got the bucket lock, and has
+			 * now been taken off it, so it's empty.
+			 */
+			for (fp = &fb->fb_futexes; *fp != f;
+			     fp = &(*fp)->f_next) {
+				KASSERT(*fp != NULL);
+			}
+			*fp = f->f_next;
+			wchan_destroy(f->f_wchan);
+			kfree(f);
+		}
+	}
+	lock_release(fb->fb_lock);
+
+	*retval = woken;
+	return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Spinlock contention benchmark.
+ *
+ * Several threads hammer on one spinlock with a short critical
+ * section. Reports the total time, the throughput, and the spread
+ * between the fastest and slowest thread, which shows how fair the
+ * lock is. Build with and without "options ticketlock" to compare.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define SLT_MAXTHREADS	32
+#define SLT_NTHREADS	8
+#define SLT_NLOOPS	10000
+#define SLT_WORK	16	/* Delay loop iterations outside the lock */
+
+static struct spinlock slt_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned slt_count;
+static struct semaphore *slt_startsem;
+static struct semaphore *slt_donesem;
+static unsigned slt_nloops;
+static uint64_t slt_times[SLT_MAXTHREADS];
+
+/* Nanoseconds since BEFORE. */
+static
+uint64_t
+slt_elapsed(time_t beforesecs, uint32_t beforensecs)
+{
+	time_t aftersecs, secs;
+	uint32_t afternsecs, nsecs;
+
+	gettime(&aftersecs, &afternsecs);
+	getinterval(beforesecs, beforensecs, aftersecs, afternsecs,
+		    &secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+static
+void
+slt_thread(void *junk, unsigned long num)
+{
+	time_t beforesecs;
+	uint32_t beforensecs;
+	volatile unsigned j;
+	unsigned i;
+
+	(void)junk;
+
+	P(slt_startsem);
+	gettime(&beforesecs, &beforensecs);
+	for (i=0; i<slt_nloops; i++) {
+		spinlock_acquire(&slt_lock);
+		slt_count++;
+		spinlock_release(&slt_lock);
+
+		/* A little work outside the lock. */
+		for (j=0; j<SLT_WORK; j++) {
+			/* nothing */
+		}
+	}
+	slt_times[num] = slt_elapsed(beforesecs, beforensecs);
+
+	V(slt_donesem);
+}
+
+/*
+ * Usage: sl1 [nthreads [nloops]]
+ */
+int
+spinlocktest(int nargs, char **args)
+{
+	time_t beforesecs;
+	uint32_t beforensecs;
+	unsigned nthreads, i;
+	uint64_t total, fastest, slowest;
+	int result;
+
+	nthreads = SLT_NTHREADS;
+	slt_nloops = SLT_NLOOPS;
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nargs > 2) {
+		slt_nloops = atoi(args[2]);
+	}
+	if (nthreads < 1 || nthreads > SLT_MAXTHREADS) {
+		kprintf("Usage: sl1 [nthreads [nloops]]; "
+			"nthreads must be 1-%u\n", SLT_MAXTHREADS);
+		return EINVAL;
+	}
+
+	slt_startsem = sem_create("slt_start", 0);
+	slt_donesem = sem_create("slt_done", 0);
+	if (slt_startsem == NULL || slt_donesem == NULL) {
+		panic("spinlocktest: sem_create failed\n");
+	}
+	slt_count = 0;
+
+	kprintf("Starting spinlock test: %u threads, %u loops each...\n",
+		nthreads, slt_nloops);
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("spinlocktest", NULL, slt_thread, NULL, i);
+		if (result) {
+			panic("spinlocktest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	gettime(&beforesecs, &beforensecs);
+	for (i=0; i<nthreads; i++) {
+		V(slt_startsem);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(slt_donesem);
+	}
+	total = slt_elapsed(beforesecs, beforensecs);
+
+	fastest = slowest = slt_times[0];
+	for (i=1; i<nthreads; i++) {
+		if (slt_times[i] < fastest) {
+			fastest = slt_times[i];
+		}
+		if (slt_times[i] > slowest) {
+			slowest = slt_times[i];
+		}
+	}
+
+	if (slt_count != nthreads * slt_nloops) {
+		kprintf("Test failed: count %u, expected %u\n",
+			slt_count, nthreads * slt_nloops);
+	}
+
+	kprintf("Total time: %llu us\n", total / 1000);
+	kprintf("Acquisitions: %u (%llu per ms)\n", slt_count,
+		total >= 1000000 ? (uint64_t)slt_count * 1000000 / total : 0);
+	kprintf("Per thread: fastest %llu us, slowest %llu us\n",
+		fastest / 1000, slowest / 1000);
+
+	sem_destroy(slt_startsem);
+	sem_destroy(slt_donesem);
+
+	kprintf("Spinlock test done.\n");
+	return 0;
+}
@@ -0,0 +1,352 @@
+/*
+ * VM system tests.
+ *
+ * vm1 runs a process's memory through its whole life many times
+ * over: an address space is set up as runprogram would, copied as
+ * fork would, and then everything is thrown away again. If physical
+ * pages aren't being reclaimed, this runs out of memory long before
+ * it finishes.
+ *
+ * vm2 is a page allocator benchmark: some threads allocate and free
+ * single pages as fast as they can. It's run with one thread and then
+ * with several, and reports how close to linear the speedup is.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <test.h>
+
+#define VMT_NCYCLES	2000
+#define VMT_TEXTPAGES	20
+#define VMT_DATAPAGES	8
+#define VMT_STACKPAGES	4
+#define VMT_KPAGES	4
+
+#define VMT_MAXTHREADS	32
+#define VMT_NTHREADS	4
+#define VMT_NLOOPS	5000
+#define VMT_BATCH	8	/* Pages each thread holds at once */
+
+/*
+ * Give NPAGES pages starting at VADDR memory.
+ */
+static
+int
+vmt_touch(struct addrspace *as, vaddr_t vaddr, unsigned npages)
+{
+	unsigned i;
+	int result;
+
+	for (i=0; i<npages; i++) {
+		result = as_touch(as, vaddr + i * PAGE_SIZE);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * One process lifetime: a parent and a forked child, both destroyed.
+ */
+static
+int
+vmt_cycle(void)
+{
+	struct proc *parent, *child;
+	struct addrspace *as;
+	vaddr_t stackptr, kbuf;
+	int result;
+
+	parent = proc_create_runprogram("vmtest");
+	if (parent == NULL) {
+		return ENOMEM;
+	}
+	as = as_create();
+	if (as == NULL) {
+		proc_destroy(parent);
+		return ENOMEM;
+	}
+	parent->p_addrspace = as;
+
+	result = as_define_region(as, 0x400000, VMT_TEXTPAGES * PAGE_SIZE,
+				  1, 0, 1);
+	if (result == 0) {
+		result = as_define_region(as, 0x10000000,
+					  VMT_DATAPAGES * PAGE_SIZE, 1, 1, 0);
+	}
+	if (result == 0) {
+		result = as_prepare_load(as);
+	}
+	if (result == 0) {
+		result = as_complete_load(as);
+	}
+	if (result == 0) {
+		result = as_define_stack(as, &stackptr);
+	}
+	/*
+	 * Pages only exist once touched; touch them all, as the
+	 * program would, so the copy and teardown have frames to move.
+	 */
+	if (result == 0) {
+		result = vmt_touch(as, 0x400000, VMT_TEXTPAGES);
+	}
+	if (result == 0) {
+		result = vmt_touch(as, 0x10000000, VMT_DATAPAGES);
+	}
+	if (result == 0) {
+		result = vmt_touch(as, stackptr - VMT_STACKPAGES * PAGE_SIZE,
+				   VMT_STACKPAGES);
+	}
+
+	child = NULL;
+	if (result == 0) {
+		child = proc_create_runprogram("vmtest child");
+		if (child == NULL) {
+			result = ENOMEM;
+		}
+	}
+	if (result == 0) {
+		result = as_copy(as, &child->p_addrspace);
+	}
+
+	/* Kernel multi-page allocations come from the same frames. */
+	if (result == 0) {
+		kbuf = alloc_kpages(VMT_KPAGES);
+		if (kbuf == 0) {
+			result = ENOMEM;
+		}
+		else {
+			free_kpages(kbuf);
+		}
+	}
+
+	if (child != NULL) {
+		if (child->p_addrspace != NULL) {
+			as_destroy(child->p_addrspace);
+			child->p_addrspace = NULL;
+		}
+		proc_destroy(child);
+	}
+	as_destroy(as);
+	parent->p_addrspace = NULL;
+	proc_destroy(parent);
+
+#ifdef UW
+	/* The process count went back to zero; eat the wakeup. */
+	P(no_proc_sem);
+#endif
+
+	return result;
+}
+
+/*
+ * Usage: vm1 [cycles]
+ */
+int
+vmstresstest(int nargs, char **args)
+{
+	unsigned ncycles, i, before, after;
+	int result;
+
+	ncycles = VMT_NCYCLES;
+	if (nargs > 1) {
+		ncycles = atoi(args[1]);
+	}
+
+#ifdef UW
+	/*
+	 * Each cycle takes the process count back to zero and eats the
+	 * resulting no_proc_sem wakeup, which never comes if any other
+	 * process is alive. Processes are only started from the menu,
+	 * which is busy running us, or by other processes; so if there
+	 * are none now, there won't be any until we're done.
+	 */
+	if (proc_getcount() != 0) {
+		kprintf("vm1: can't run while user processes exist\n");
+		return EBUSY;
+	}
+#endif
+
+	kprintf("Starting VM stress test: %u cycles...\n", ncycles);
+
+	/* One to warm up kmalloc's page pools. */
+	result = vmt_cycle();
+	if (result) {
+		kprintf("Test failed: cycle 0: %s\n", strerror(result));
+		return result;
+	}
+	before = vm_freepages();
+
+	for (i=1; i<ncycles; i++) {
+		result = vmt_cycle();
+		if (result) {
+			kprintf("Test failed: cycle %u: %s (%u pages free)\n",
+				i, strerror(result), vm_freepages());
+			return result;
+		}
+		if (i % 500 == 0) {
+			kprintf("%u cycles, %u pages free\n", i,
+				vm_freepages());
+		}
+	}
+
+	after = vm_freepages();
+	kprintf("Free pages: %u before, %u after\n", before, after);
+	if (after < before) {
+		kprintf("Test failed: %u pages not returned\n",
+			before - after);
+		return ENOMEM;
+	}
+	kprintf("VM stress test done.\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+static struct semaphore *vmt_startsem;
+static struct semaphore *vmt_donesem;
+static unsigned vmt_nloops;
+static volatile bool vmt_failed;
+
+/* Nanoseconds since BEFORE. */
+static
+uint64_t
+vmt_elapsed(time_t beforesecs, uint32_t beforensecs)
+{
+	time_t aftersecs, secs;
+	uint32_t afternsecs, nsecs;
+
+	gettime(&aftersecs, &afternsecs);
+	getinterval(beforesecs, beforensecs, aftersecs, afternsecs,
+		    &secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+static
+void
+vmt_thread(void *junk, unsigned long num)
+{
+	vaddr_t pages[VMT_BATCH];
+	unsigned i, j;
+
+	(void)junk;
+	(void)num;
+
+	P(vmt_startsem);
+	for (i=0; i<vmt_nloops; i++) {
+		for (j=0; j<VMT_BATCH; j++) {
+			pages[j] = alloc_kpages(1);
+			if (pages[j] == 0) {
+				vmt_failed = true;
+				break;
+			}
+			/* Touch it, as a real user would. */
+			*(volatile unsigned *)pages[j] = j;
+		}
+		while (j-- > 0) {
+			free_kpages(pages[j]);
+		}
+	}
+	V(vmt_donesem);
+}
+
+/*
+ * Run NTHREADS allocating threads; return the time taken in ns.
+ */
+static
+uint64_t
+vmt_run(unsigned nthreads)
+{
+	time_t beforesecs;
+	uint32_t beforensecs;
+	unsigned i;
+	int result;
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("vmbench", NULL, vmt_thread, NULL, i);
+		if (result) {
+			panic("vmbenchtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	gettime(&beforesecs, &beforensecs);
+	for (i=0; i<nthreads; i++) {
+		V(vmt_startsem);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(vmt_donesem);
+	}
+	return vmt_elapsed(beforesecs, beforensecs);
+}
+
+/*
+ * Usage: vm2 [nthreads [nloops]]
+ */
+int
+vmbenchtest(int nargs, char **args)
+{
+	unsigned nthreads, nops;
+	uint64_t one, many, speedup;
+
+	nthreads = VMT_NTHREADS;
+	vmt_nloops = VMT_NLOOPS;
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nargs > 2) {
+		vmt_nloops = atoi(args[2]);
+	}
+	if (nthreads < 1 || nthreads > VMT_MAXTHREADS) {
+		kprintf("Usage: vm2 [nthreads [nloops]]; "
+			"nthreads must be 1-%u\n", VMT_MAXTHREADS);
+		return EINVAL;
+	}
+
+	vmt_startsem = sem_create("vmt_start", 0);
+	vmt_donesem = sem_create("vmt_done", 0);
+	if (vmt_startsem == NULL || vmt_donesem == NULL) {
+		panic("vmbenchtest: sem_create failed\n");
+	}
+	vmt_failed = false;
+
+	kprintf("Starting page allocator benchmark: %u threads, "
+		"%u loops of %u pages each...\n",
+		nthreads, vmt_nloops, VMT_BATCH);
+
+	nops = vmt_nloops * VMT_BATCH;
+	one = vmt_run(1);
+	many = vmt_run(nthreads);
+	/* Don't divide by zero if the clock is too coarse. */
+	if (one == 0) {
+		one = 1;
+	}
+	if (many == 0) {
+		many = 1;
+	}
+	/* Perfect scaling takes as long with N threads as with one. */
+	speedup = (uint64_t)nthreads * one * 100 / many;
+
+	kprintf("1 thread: %llu ns, %llu allocs/sec\n", one,
+		(uint64_t)nops * 1000000000 / one);
+	kprintf("%u threads: %llu ns, %llu allocs/sec\n", nthreads, many,
+		(uint64_t)nthreads * nops * 1000000000 / many);
+	kprintf("Speedup: %llu.%02llu (ideal %u)\n",
+		speedup / 100, speedup % 100, nthreads);
+	if (vmt_failed) {
+		kprintf("Test failed: ran out of memory\n");
+	}
+
+	sem_destroy(vmt_startsem);
+	sem_destroy(vmt_donesem);
+	kprintf("Page allocator benchmark done.\n");
+	return vmt_failed ? ENOMEM : 0;
+}
@@ -30,9 +30,10 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
-#include <wchan.h>
 #include <clock.h>
 #include <thread.h>
+#include <threadlist.h>
+#include <mainbus.h>
 #include <current.h>
 
 /*
@@ -40,35 +41,19 @@
  *
  * This is pretty primitive. A real kernel will typically have some
  * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * points in the future. We only have timed sleeps (see
+ * thread_sleep_until), which are run from hardclock and so have a
+ * resolution of one hardclock.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
  */
 
 /*
- * Timing constants. These should be tuned along with any work done on
- * the scheduler.
+ * Longest a cpu will go without a hardclock when it has stopped the
+ * periodic tick (in hardclocks).
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
-
-/*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
- */
-static struct wchan *lbolt;
-
-/*
- * Setup.
- */
-void
-hardclock_bootstrap(void)
-{
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
-	}
-}
+#define HARDCLOCK_MAXSKIP	HZ
 
 /*
  * This is called once per second, on one processor, by the timer
@@ -77,8 +62,12 @@ hardclock_bootstrap(void)
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
-	wchan_wakeall(lbolt);
+	/*
+	 * Timed sleepers are normally woken from hardclock. This is
+	 * just a backstop in case every cpu has stopped its
+	 * hardclock.
+	 */
+	thread_timed_wakeup();
 }
 
 /*
@@ -88,18 +77,109 @@ timerclock(void)
 void
 hardclock(void)
 {
+	bool waiting;
+
 	/*
 	 * Collect statistics here as desired.
 	 */
 
 	curcpu->c_hardclocks++;
+	thread_timed_wakeup();
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
-	thread_yield();
+	thread_timeslice();
+
+	/*
+	 * If nothing else is waiting to run here, more ticks would
+	 * only find that out again; stop them until something is.
+	 */
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (threadlist_isempty(&curcpu->c_runqueue)) {
+		hardclock_stop();
+		/*
+		 * A remote wakeup that arrived before c_tickless was
+		 * set won't have sent an IPI; look for one now.
+		 */
+		if (thread_inbox_drain()) {
+			hardclock_start();
+		}
+	}
+	waiting = !threadlist_isempty(&curcpu->c_runqueue);
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	/*
+	 * Idle cpus aren't ticking and won't come to steal on their
+	 * own; as long as threads are waiting here, keep asking.
+	 * (thread_kick_idle only asks when one of them may move.)
+	 */
+	if (waiting) {
+		thread_kick_idle();
+	}
+}
+
+/*
+ * Tickless operation.
+ *
+ * A cpu that is idle, or that has only one thread to run, has no use
+ * for the periodic hardclock: there is nothing to preempt or switch
+ * to. hardclock_stop() pushes the current cpu's next hardclock out to
+ * the next timed sleep wakeup, or HARDCLOCK_MAXSKIP ticks from now if
+ * that's sooner, and sets c_tickless; hardclock_start() puts it back
+ * to ticking every 1/HZ seconds.
+ *
+ * Anyone making a thread runnable on a cpu with c_tickless set has to
+ * get it ticking again (see thread_make_runnable) or the new thread
+ * won't get to run until the current one blocks.
+ *
+ * Both must be called on the cpu in question, with interrupts off
+ * and its run queue lock held.
+ */
+void
+hardclock_stop(void)
+{
+	struct timespec wakeup;
+	time_t secs, dsecs;
+	uint32_t nsecs, dnsecs;
+	unsigned nticks;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	nticks = HARDCLOCK_MAXSKIP;
+	if (thread_next_wakeup(&wakeup)) {
+		gettime(&secs, &nsecs);
+		if (wakeup.tv_sec < secs ||
+		    (wakeup.tv_sec == secs &&
+		     (uint32_t)wakeup.tv_nsec <= nsecs)) {
+			nticks = 1;
+		}
+		else {
+			getinterval(secs, nsecs,
+				    wakeup.tv_sec, wakeup.tv_nsec,
+				    &dsecs, &dnsecs);
+			if (dsecs < HARDCLOCK_MAXSKIP / HZ) {
+				nticks = dsecs * HZ +
+					dnsecs / (1000000000 / HZ) + 1;
+			}
+		}
+	}
+
+	curcpu->c_tickless = true;
+	mainbus_set_hardclock(nticks);
+}
+
+void
+hardclock_start(void)
+{
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	if (curcpu->c_tickless) {
+		curcpu->c_tickless = false;
+		mainbus_set_hardclock(1);
+	}
 }
 
 /*
@@ -108,9 +188,12 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	while (num_secs > 0) {
-		wchan_lock(lbolt);
-		wchan_sleep(lbolt);
-		num_secs--;
-	}
+	struct timespec wakeup;
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	wakeup.tv_sec = secs + num_secs;
+	wakeup.tv_nsec = nsecs;
+	thread_sleep_until(&wakeup);
 }
@@ -0,0 +1,268 @@
+/*
+ * Lock contention profiling. See lockprof.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <lockprof.h>
+
+/*
+ * lp_listed holds this, mixed with the record's address, while the
+ * record is on the list. spinlock_init can be called again on a
+ * static spinlock that's already been used, and sometimes is; the
+ * record mustn't be put on the list twice. Records in freshly
+ * allocated memory hold garbage, which is vanishingly unlikely to
+ * match.
+ */
+#define LOCKPROF_MAGIC	0x10c4f00d
+#define LOCKPROF_LISTED(lp)	(LOCKPROF_MAGIC ^ (uintptr_t)(lp))
+
+/* All the records, and how many there are. */
+static struct lockprof *lockprof_list;
+static unsigned lockprof_num;
+
+/*
+ * The list can't be protected by a spinlock, because spinlocks are
+ * profiled themselves; use the raw lock word instead. Nothing is done
+ * holding it but list manipulation and copying.
+ */
+static volatile spinlock_data_t lockprof_listlock = SPINLOCK_DATA_INITIALIZER;
+
+/* Set once gettime() works. */
+static bool lockprof_clock;
+
+static
+int
+lockprof_lock(void)
+{
+	int spl;
+
+	spl = splhigh();
+	while (spinlock_data_testandset(&lockprof_listlock) != 0) {
+		/* spin */
+	}
+	return spl;
+}
+
+static
+void
+lockprof_unlock(int spl)
+{
+	spinlock_data_set(&lockprof_listlock, 0);
+	splx(spl);
+}
+
+void
+lockprof_bootstrap(void)
+{
+	lockprof_clock = true;
+}
+
+uint64_t
+lockprof_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	if (!lockprof_clock) {
+		return 0;
+	}
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+bool
+lockprof_listed(const struct lockprof *lp)
+{
+	return lp->lp_listed == LOCKPROF_LISTED(lp);
+}
+
+void
+lockprof_add(struct lockprof *lp, int kind, const void *lock,
+	     const char *name, const void *site)
+{
+	int spl;
+
+	spl = lockprof_lock();
+	if (!lockprof_listed(lp)) {
+		lp->lp_kind = kind;
+		lp->lp_lock = lock;
+		lp->lp_name = name;
+		lp->lp_site = site;
+		lp->lp_seq = 0;
+		lp->lp_acquires = 0;
+		lp->lp_contended = 0;
+		lp->lp_wait = 0;
+		lp->lp_maxhold = 0;
+		lp->lp_longholds = 0;
+
+		lp->lp_next = lockprof_list;
+		lp->lp_prevp = &lockprof_list;
+		if (lockprof_list != NULL) {
+			lockprof_list->lp_prevp = &lp->lp_next;
+		}
+		lockprof_list = lp;
+		lp->lp_listed = LOCKPROF_LISTED(lp);
+		lockprof_num++;
+	}
+	lockprof_unlock(spl);
+}
+
+void
+lockprof_remove(struct lockprof *lp)
+{
+	int spl;
+
+	spl = lockprof_lock();
+	KASSERT(lockprof_listed(lp));
+	*lp->lp_prevp = lp->lp_next;
+	if (lp->lp_next != NULL) {
+		lp->lp_next->lp_prevp = lp->lp_prevp;
+	}
+	lp->lp_listed = 0;
+	lockprof_num--;
+	lockprof_unlock(spl);
+}
+
+void
+lockprof_acquired(struct lockprof *lp, bool contended, uint64_t wait)
+{
+	lp->lp_seq++;
+	lp->lp_acquires++;
+	if (contended) {
+		lp->lp_contended++;
+		lp->lp_wait += wait;
+	}
+	lp->lp_seq++;
+}
+
+void
+lockprof_hold(struct lockprof *lp, uint64_t held)
+{
+	if (held > lp->lp_maxhold) {
+		lp->lp_seq++;
+		lp->lp_maxhold = held;
+		lp->lp_seq++;
+	}
+}
+
+void
+lockprof_longhold(struct lockprof *lp)
+{
+	lp->lp_seq++;
+	lp->lp_longholds++;
+	lp->lp_seq++;
+}
+
+/*
+ * What the printer keeps of a record. The lock may be destroyed as
+ * soon as the list is unlocked, so the name is copied.
+ */
+struct lockprof_snap {
+	int ls_kind;
+	char ls_name[24];
+	const void *ls_site;
+	unsigned ls_acquires;
+	unsigned ls_contended;
+	uint64_t ls_wait;
+	uint64_t ls_maxhold;
+	unsigned ls_longholds;
+};
+
+/*
+ * Copy LP into LS. The holder of the lock may be updating it on
+ * another cpu; if so, try again. (It can't be on this one, because
+ * updates are done with interrupts off.)
+ */
+static
+void
+lockprof_copy(const struct lockprof *lp, struct lockprof_snap *ls)
+{
+	unsigned seq;
+
+	do {
+		seq = lp->lp_seq;
+		ls->ls_acquires = lp->lp_acquires;
+		ls->ls_contended = lp->lp_contended;
+		ls->ls_wait = lp->lp_wait;
+		ls->ls_maxhold = lp->lp_maxhold;
+		ls->ls_longholds = lp->lp_longholds;
+	} while ((seq & 1) != 0 || lp->lp_seq != seq);
+
+	ls->ls_kind = lp->lp_kind;
+	ls->ls_site = lp->lp_site;
+	if (lp->lp_name != NULL) {
+		snprintf(ls->ls_name, sizeof(ls->ls_name), "%s", lp->lp_name);
+	}
+	else {
+		snprintf(ls->ls_name, sizeof(ls->ls_name), "%p", lp->lp_lock);
+	}
+}
+
+/*
+ * Print the top MAX records by contention count. The records are
+ * copied first, since kprintf itself takes locks that update them;
+ * the space for the copies is allocated before locking the list, for
+ * the same reason, with some slack for locks made meanwhile.
+ */
+void
+lockprof_printstats(unsigned max)
+{
+	static const char *const kinds[] = { "spin", "lock", "sem" };
+	struct lockprof_snap *snap, tmp;
+	struct lockprof *lp;
+	unsigned room, num, i, j;
+	int spl;
+
+	room = lockprof_num + 32;
+	snap = kmalloc(room * sizeof(*snap));
+	if (snap == NULL) {
+		kprintf("lockprof: Out of memory\n");
+		return;
+	}
+
+	num = 0;
+	spl = lockprof_lock();
+	for (lp = lockprof_list; lp != NULL && num < room; lp = lp->lp_next) {
+		lockprof_copy(lp, &snap[num++]);
+	}
+	lockprof_unlock(spl);
+
+	/* Insertion sort, most contended first, then by wait time. */
+	for (i=1; i<num; i++) {
+		tmp = snap[i];
+		for (j=i; j>0 &&
+			     (snap[j-1].ls_contended < tmp.ls_contended ||
+			      (snap[j-1].ls_contended == tmp.ls_contended &&
+			       snap[j-1].ls_wait < tmp.ls_wait)); j--) {
+			snap[j] = snap[j-1];
+		}
+		snap[j] = tmp;
+	}
+
+	kprintf("kind name                 acquires  contended"
+		"            wait         maxhold\n");
+	for (i=0; i<num && i<max; i++) {
+		if (snap[i].ls_acquires == 0) {
+			break;
+		}
+		kprintf("%-4s %-18s %10u %10u %15llu %15llu",
+			kinds[snap[i].ls_kind], snap[i].ls_name,
+			snap[i].ls_acquires, snap[i].ls_contended,
+			snap[i].ls_wait, snap[i].ls_maxhold);
+		if (snap[i].ls_longholds != 0) {
+			kprintf(" (%u longer)", snap[i].ls_longholds);
+		}
+		if (snap[i].ls_site != NULL) {
+			kprintf(" init@%p", snap[i].ls_site);
+		}
+		kprintf("\n");
+	}
+	kprintf("(spin times and lock hold times in cycles, others in ns; "
+		"%u records)\n", num);
+
+	kfree(snap);
+}
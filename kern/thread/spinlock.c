@@ -36,11 +36,34 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>	/* for curcpu */
+#include <lockprof.h>
 
 /*
  * Spinlocks.
  */
 
+/*
+ * Backoff while waiting, in iterations of a delay loop. Each failed
+ * attempt doubles the delay up to SPINLOCK_BACKOFF_MAX, so CPUs
+ * fighting over a hot lock spread out instead of all hammering the
+ * bus the moment it's released. For ticket locks the delay is instead
+ * proportional to how many CPUs are ahead of us in line.
+ */
+#define SPINLOCK_BACKOFF_MIN	4
+#define SPINLOCK_BACKOFF_MAX	1024
+#define SPINLOCK_BACKOFF_TICKET	32
+
+static
+void
+spinlock_delay(unsigned count)
+{
+	volatile unsigned i;
+
+	for (i=0; i<count; i++) {
+		/* nothing */
+	}
+}
+
 
 /*
  * Initialize spinlock.
@@ -49,7 +72,16 @@ void
 spinlock_init(struct spinlock *lk)
 {
 	spinlock_data_set(&lk->lk_lock, 0);
+#if OPT_TICKETLOCK
+	spinlock_data_set(&lk->lk_serving, 0);
+#endif
 	lk->lk_holder = NULL;
+#if OPT_LOCKPROF
+	/* Note who made it, to tell spinlocks apart when printing. */
+	lockprof_add(&lk->lk_prof, LOCKPROF_SPIN, lk, NULL,
+		     __builtin_return_address(0));
+	lk->lk_acqtime = 0;
+#endif
 }
 
 /*
@@ -59,7 +91,15 @@ void
 spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
+#if OPT_TICKETLOCK
+	KASSERT(spinlock_data_get(&lk->lk_lock) ==
+		spinlock_data_get(&lk->lk_serving));
+#else
 	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+#endif
+#if OPT_LOCKPROF
+	lockprof_remove(&lk->lk_prof);
+#endif
 }
 
 /*
@@ -73,6 +113,15 @@ void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+#if OPT_TICKETLOCK
+	spinlock_data_t ticket, serving;
+#else
+	unsigned backoff;
+#endif
+#if OPT_LOCKPROF
+	uint32_t start, now;
+	bool contended;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,6 +136,35 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
+#if OPT_LOCKPROF
+	start = 0;
+	contended = false;
+#endif
+
+#if OPT_TICKETLOCK
+	/*
+	 * Take a ticket and wait for it to come up. Fetch-and-add is
+	 * a machine-level atomic operation that adds to the word and
+	 * returns its previous value, so every cpu gets a different
+	 * ticket. (They wrap around; that's fine as long as there
+	 * are fewer than 2^32 cpus.)
+	 */
+	ticket = spinlock_data_fetchadd(&lk->lk_lock, 1);
+	while (1) {
+		serving = spinlock_data_get(&lk->lk_serving);
+		if (serving == ticket) {
+			break;
+		}
+#if OPT_LOCKPROF
+		if (!contended) {
+			contended = true;
+			start = cpu_cycles();
+		}
+#endif
+		spinlock_delay((ticket - serving) * SPINLOCK_BACKOFF_TICKET);
+	}
+#else
+	backoff = SPINLOCK_BACKOFF_MIN;
 	while (1) {
 		/*
 		 * Do test-test-and-set, that is, read first before
@@ -99,15 +177,45 @@ spinlock_acquire(struct spinlock *lk)
 		 * we don't.
 		 */
 		if (spinlock_data_get(&lk->lk_lock) != 0) {
+#if OPT_LOCKPROF
+			if (!contended) {
+				contended = true;
+				start = cpu_cycles();
+			}
+#endif
 			continue;
 		}
 		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
+#if OPT_LOCKPROF
+			if (!contended) {
+				contended = true;
+				start = cpu_cycles();
+			}
+#endif
+			/* Lost a race; back off before trying again. */
+			spinlock_delay(backoff);
+			if (backoff < SPINLOCK_BACKOFF_MAX) {
+				backoff *= 2;
+			}
 			continue;
 		}
 		break;
 	}
+#endif
 
 	lk->lk_holder = mycpu;
+
+#if OPT_LOCKPROF
+	/* Statically initialized spinlocks are listed on first use. */
+	if (!lockprof_listed(&lk->lk_prof)) {
+		lockprof_add(&lk->lk_prof, LOCKPROF_SPIN, lk, NULL, NULL);
+	}
+	now = cpu_cycles();
+	/* The counter may have been reset meanwhile. */
+	lockprof_acquired(&lk->lk_prof, contended,
+			  now >= start ? now - start : now);
+	lk->lk_acqtime = now;
+#endif
 }
 
 /*
@@ -116,13 +224,29 @@ spinlock_acquire(struct spinlock *lk)
 void
 spinlock_release(struct spinlock *lk)
 {
+#if OPT_LOCKPROF
+	uint32_t now;
+#endif
+
 	/* this must work before curcpu initialization */
 	if (CURCPU_EXISTS()) {
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKPROF
+	now = cpu_cycles();
+	lockprof_hold(&lk->lk_prof, now >= lk->lk_acqtime ?
+		      now - lk->lk_acqtime : now);
+#endif
+
 	lk->lk_holder = NULL;
+#if OPT_TICKETLOCK
+	/* Only the holder writes lk_serving, so this needn't be atomic. */
+	spinlock_data_set(&lk->lk_serving,
+			  spinlock_data_get(&lk->lk_serving) + 1);
+#else
 	spinlock_data_set(&lk->lk_lock, 0);
+#endif
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
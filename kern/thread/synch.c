@@ -38,14 +38,17 @@
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <cpu.h>
 #include <synch.h>
+#include <lockprof.h>
 
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
 
+static
 struct semaphore *
-sem_create(const char *name, int initial_count)
+sem_create_common(const char *name, int initial_count, bool handoff)
 {
         struct semaphore *sem;
 
@@ -71,16 +74,37 @@ sem_create(const char *name, int initial_count)
 
 	spinlock_init(&sem->sem_lock);
         sem->sem_count = initial_count;
+	sem->sem_handoff = handoff;
+	sem->sem_waiters = 0;
+#if OPT_LOCKPROF
+	lockprof_add(&sem->sem_prof, LOCKPROF_SEM, sem, sem->sem_name, NULL);
+#endif
 
         return sem;
 }
 
+struct semaphore *
+sem_create(const char *name, int initial_count)
+{
+	return sem_create_common(name, initial_count, false);
+}
+
+struct semaphore *
+sem_create_fifo(const char *name, int initial_count)
+{
+	return sem_create_common(name, initial_count, true);
+}
+
 void
 sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
 	/* wchan_cleanup will assert if anyone's waiting on it */
+	KASSERT(sem->sem_waiters == 0);
+#if OPT_LOCKPROF
+	lockprof_remove(&sem->sem_prof);
+#endif
 	spinlock_cleanup(&sem->sem_lock);
 	wchan_destroy(sem->sem_wchan);
         kfree(sem->sem_name);
@@ -90,6 +114,11 @@ sem_destroy(struct semaphore *sem)
 void 
 P(struct semaphore *sem)
 {
+#if OPT_LOCKPROF
+	uint64_t start = 0;
+	bool contended = false;
+#endif
+
         KASSERT(sem != NULL);
 
         /*
@@ -101,32 +130,78 @@ P(struct semaphore *sem)
         KASSERT(curthread->t_in_interrupt == false);
 
 	spinlock_acquire(&sem->sem_lock);
-        while (sem->sem_count == 0) {
+	if (sem->sem_handoff) {
 		/*
-		 * Bridge to the wchan lock, so if someone else comes
-		 * along in V right this instant the wakeup can't go
-		 * through on the wchan until we've finished going to
-		 * sleep. Note that wchan_sleep unlocks the wchan.
-		 *
-		 * Note that we don't maintain strict FIFO ordering of
-		 * threads going through the semaphore; that is, we
-		 * might "get" it on the first try even if other
-		 * threads are waiting. Apparently according to some
-		 * textbooks semaphores must for some reason have
-		 * strict ordering. Too bad. :-)
-		 *
-		 * Exercise: how would you implement strict FIFO
-		 * ordering?
+		 * Handoff mode. Take a free count only if nobody is
+		 * queued ahead of us; otherwise join the back of the
+		 * wchan (which is FIFO) and wait for V to give us
+		 * the count directly. When we wake up the count is
+		 * already ours, so there is nothing to recheck.
 		 */
-		wchan_lock(sem->sem_wchan);
+		if (sem->sem_count > 0 && sem->sem_waiters == 0) {
+			sem->sem_count--;
+#if OPT_LOCKPROF
+			lockprof_acquired(&sem->sem_prof, false, 0);
+#endif
+			spinlock_release(&sem->sem_lock);
+		}
+		else {
+#if OPT_LOCKPROF
+			contended = true;
+			start = lockprof_now();
+#endif
+			sem->sem_waiters++;
+			wchan_lock(sem->sem_wchan);
+			spinlock_release(&sem->sem_lock);
+			wchan_sleep(sem->sem_wchan);
+#if OPT_LOCKPROF
+			spinlock_acquire(&sem->sem_lock);
+			lockprof_acquired(&sem->sem_prof, true,
+					  start != 0 ? lockprof_now() - start : 0);
+			spinlock_release(&sem->sem_lock);
+#endif
+		}
+	}
+	else {
+		while (sem->sem_count == 0) {
+#if OPT_LOCKPROF
+			if (!contended) {
+				contended = true;
+				start = lockprof_now();
+			}
+#endif
+			/*
+			 * Bridge to the wchan lock, so if someone
+			 * else comes along in V right this instant
+			 * the wakeup can't go through on the wchan
+			 * until we've finished going to sleep. Note
+			 * that wchan_sleep unlocks the wchan.
+			 *
+			 * Note that we don't maintain strict FIFO
+			 * ordering of threads going through the
+			 * semaphore; that is, we might "get" it on
+			 * the first try even if other threads are
+			 * waiting. Apparently according to some
+			 * textbooks semaphores must for some reason
+			 * have strict ordering. Too bad. :-)
+			 *
+			 * (Semaphores made with sem_create_fifo do;
+			 * see above.)
+			 */
+			wchan_lock(sem->sem_wchan);
+			spinlock_release(&sem->sem_lock);
+			wchan_sleep(sem->sem_wchan);
+
+			spinlock_acquire(&sem->sem_lock);
+		}
+		KASSERT(sem->sem_count > 0);
+		sem->sem_count--;
+#if OPT_LOCKPROF
+		lockprof_acquired(&sem->sem_prof, contended,
+				  start != 0 ? lockprof_now() - start : 0);
+#endif
 		spinlock_release(&sem->sem_lock);
-                wchan_sleep(sem->sem_wchan);
-
-		spinlock_acquire(&sem->sem_lock);
-        }
-        KASSERT(sem->sem_count > 0);
-        sem->sem_count--;
-	spinlock_release(&sem->sem_lock);
+	}
 }
 
 void
@@ -136,6 +211,18 @@ V(struct semaphore *sem)
 
 	spinlock_acquire(&sem->sem_lock);
 
+	if (sem->sem_handoff && sem->sem_waiters > 0) {
+		/*
+		 * Hand the count to the longest waiter. It is already
+		 * on the wchan (it queued itself before dropping
+		 * sem_lock), so the wakeup cannot be lost.
+		 */
+		sem->sem_waiters--;
+		wchan_wakeone(sem->sem_wchan);
+		spinlock_release(&sem->sem_lock);
+		return;
+	}
+
         sem->sem_count++;
         KASSERT(sem->sem_count > 0);
 	wchan_wakeone(sem->sem_wchan);
@@ -162,9 +249,24 @@ lock_create(const char *name)
                 kfree(lock);
                 return NULL;
         }
-        
-        // add stuff here as needed
-        
+
+        lock->lk_wchan = wchan_create(lock->lk_name);
+        if (lock->lk_wchan == NULL) {
+                kfree(lock->lk_name);
+                kfree(lock);
+                return NULL;
+        }
+
+        spinlock_init(&lock->lk_lock);
+        lock->lk_owner = NULL;
+        lock->lk_nextheld = NULL;
+        lock->lk_waiters = 0;
+#if OPT_LOCKPROF
+        lockprof_add(&lock->lk_prof, LOCKPROF_LOCK, lock, lock->lk_name,
+                     NULL);
+        lock->lk_acqcpu = NULL;
+#endif
+
         return lock;
 }
 
@@ -172,37 +274,274 @@ void
 lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
-
-        // add stuff here as needed
-        
+        KASSERT(lock->lk_owner == NULL);
+        KASSERT(lock->lk_waiters == 0);
+
+#if OPT_LOCKPROF
+        lockprof_remove(&lock->lk_prof);
+#endif
+        spinlock_cleanup(&lock->lk_lock);
+        wchan_destroy(lock->lk_wchan);
         kfree(lock->lk_name);
         kfree(lock);
 }
 
+/*
+ * How many times lock_acquire polls a lock whose owner is running on
+ * another cpu before giving up and sleeping. This should be roughly
+ * the cost of a context switch or two.
+ */
+#define LOCK_SPIN_LIMIT 1000
+
+/*
+ * Priority inheritance.
+ *
+ * A thread going to sleep on a lock donates its effective priority to
+ * the lock's owner; if the owner is itself asleep on a lock, to that
+ * lock's owner in turn, and so on for up to LOCK_PI_MAXDEPTH links.
+ * When a thread gets a lock after waiting for it, it takes over what
+ * the remaining waiters were lending the previous owner. When a
+ * thread that has inherited something releases a lock, it recomputes
+ * its inheritance from the waiters on the locks it still holds.
+ *
+ * lock_pi_lock protects t_inherited and t_blockedon. lk_waiters, the
+ * number of threads blocked on a lock, is changed holding both it and
+ * lk_lock, so either is enough to read it. lock_pi_lock is only taken
+ * on the contended path and by threads that have inherited something.
+ * The order is lk_lock, then lock_pi_lock, then wchan and run queue
+ * locks.
+ *
+ * Links past the first are followed holding only lock_pi_lock, not
+ * the lk_lock of the lock in question. That works because while a
+ * lock has a thread blocked on it (lk_waiters > 0), lk_owner is only
+ * changed with lock_pi_lock held as well. So the owner found is the
+ * real one, and it can't let go of the lock, and go away, while we
+ * are donating to it. The blocked thread in turn can't stop being
+ * blocked, so the lock can't be destroyed either.
+ */
+#define LOCK_PI_MAXDEPTH 8
+
+static struct spinlock lock_pi_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Donate PRIORITY along the chain of owners starting at LOCK.
+ */
+static
+void
+lock_donate(struct lock *lock, int priority)
+{
+	struct thread *owner;
+	unsigned depth;
+
+	KASSERT(spinlock_do_i_hold(&lock_pi_lock));
+
+	for (depth = 0; lock != NULL && depth < LOCK_PI_MAXDEPTH; depth++) {
+		/* Past the first link, someone is blocked on it. */
+		KASSERT(depth == 0 || lock->lk_waiters > 0);
+		owner = lock->lk_owner;
+		if (owner == NULL || thread_priority(owner) <= priority) {
+			/* Nobody further along needs it either. */
+			break;
+		}
+		thread_inherit_priority(owner, priority);
+		lock = owner->t_blockedon;
+	}
+}
+
+/*
+ * Recompute what the current thread inherits from the locks it holds.
+ */
+static
+void
+lock_reinherit(void)
+{
+	struct lock *lk;
+	int best, p;
+
+	KASSERT(spinlock_do_i_hold(&lock_pi_lock));
+
+	best = THREAD_NO_INHERIT;
+	for (lk = curthread->t_heldlocks; lk != NULL; lk = lk->lk_nextheld) {
+		p = wchan_best_priority(lk->lk_wchan);
+		if (p < best) {
+			best = p;
+		}
+	}
+	thread_inherit_priority(curthread, best);
+}
+
 void
 lock_acquire(struct lock *lock)
 {
-        // Write this
+	struct thread *owner;
+	unsigned spins;
+	bool blocked;
+	int best;
+#if OPT_LOCKPROF
+	uint64_t start = 0;
+	bool contended = false;
+#endif
+
+	KASSERT(lock != NULL);
+
+	/* May not block in an interrupt handler. */
+	KASSERT(curthread->t_in_interrupt == false);
+
+	/* Nor acquire a lock we already hold. */
+	KASSERT(lock->lk_owner != curthread);
+
+	spinlock_acquire(&lock->lk_lock);
+
+	/*
+	 * If cv_broadcast moved us here from a CV, we're already
+	 * blocked on the lock and counted in lk_waiters. (Only we
+	 * change our own t_blockedon while we're awake, so we can
+	 * look at it without lock_pi_lock.)
+	 */
+	blocked = curthread->t_blockedon == lock;
+	while (lock->lk_owner != NULL) {
+		owner = lock->lk_owner;
+#if OPT_LOCKPROF
+		if (!contended) {
+			contended = true;
+			start = lockprof_now();
+		}
+#endif
 
-        (void)lock;  // suppress warning until code gets written
+		/*
+		 * If the owner is running on another cpu, it'll
+		 * probably let go soon; poll for a while without
+		 * holding anything. The owner can't go away while
+		 * we hold lk_lock, so it's safe to look at it here,
+		 * but not once we've let go; after that we only look
+		 * at lk_owner.
+		 */
+		if (owner->t_state == S_RUN &&
+		    owner->t_cpu != curcpu->c_self) {
+			spinlock_release(&lock->lk_lock);
+			for (spins = 0; spins < LOCK_SPIN_LIMIT; spins++) {
+				if (lock->lk_owner != owner) {
+					break;
+				}
+			}
+			spinlock_acquire(&lock->lk_lock);
+			if (lock->lk_owner != owner) {
+				/* Owner changed; recheck from scratch. */
+				continue;
+			}
+		}
+
+		/* Lend the owner our priority while we wait. */
+		spinlock_acquire(&lock_pi_lock);
+		if (!blocked) {
+			curthread->t_blockedon = lock;
+			lock->lk_waiters++;
+			blocked = true;
+		}
+		lock_donate(lock, thread_priority(curthread));
+		spinlock_release(&lock_pi_lock);
+
+		/*
+		 * Sleep. As in P(), lock the wchan before releasing
+		 * lk_lock so a release can't slip through between.
+		 */
+		wchan_lock(lock->lk_wchan);
+		spinlock_release(&lock->lk_lock);
+		wchan_sleep(lock->lk_wchan);
+
+		spinlock_acquire(&lock->lk_lock);
+	}
+	lock->lk_nextheld = curthread->t_heldlocks;
+	curthread->t_heldlocks = lock;
+
+	if (blocked) {
+		/* Inherit from whoever is still waiting. */
+		spinlock_acquire(&lock_pi_lock);
+		curthread->t_blockedon = NULL;
+		KASSERT(lock->lk_waiters > 0);
+		lock->lk_waiters--;
+		lock->lk_owner = curthread;
+		best = wchan_best_priority(lock->lk_wchan);
+		if (best < curthread->t_inherited) {
+			thread_inherit_priority(curthread, best);
+		}
+		spinlock_release(&lock_pi_lock);
+	}
+	else if (lock->lk_waiters > 0) {
+		/* Got in ahead of a waiter; see lock_donate. */
+		spinlock_acquire(&lock_pi_lock);
+		lock->lk_owner = curthread;
+		spinlock_release(&lock_pi_lock);
+	}
+	else {
+		lock->lk_owner = curthread;
+	}
+#if OPT_LOCKPROF
+	lockprof_acquired(&lock->lk_prof, contended,
+			  start != 0 ? lockprof_now() - start : 0);
+	lock->lk_acqtime = cpu_cycles();
+	lock->lk_acqcpu = curcpu->c_self;
+	lock->lk_acqclock = curcpu->c_hardclocks;
+#endif
+	spinlock_release(&lock->lk_lock);
 }
 
 void
 lock_release(struct lock *lock)
 {
-        // Write this
-
-        (void)lock;  // suppress warning until code gets written
+	struct lock **lp;
+#if OPT_LOCKPROF
+	uint32_t now;
+#endif
+
+	KASSERT(lock != NULL);
+	KASSERT(lock->lk_owner == curthread);
+
+	/* Take it off our list of held locks. */
+	for (lp = &curthread->t_heldlocks; *lp != lock;
+	     lp = &(*lp)->lk_nextheld) {
+		KASSERT(*lp != NULL);
+	}
+	*lp = lock->lk_nextheld;
+	lock->lk_nextheld = NULL;
+
+	spinlock_acquire(&lock->lk_lock);
+#if OPT_LOCKPROF
+	/* See lockprof.h for why only some holds can be timed. */
+	now = cpu_cycles();
+	if (lock->lk_acqcpu == curcpu->c_self &&
+	    lock->lk_acqclock == curcpu->c_hardclocks &&
+	    now >= lock->lk_acqtime) {
+		lockprof_hold(&lock->lk_prof, now - lock->lk_acqtime);
+	}
+	else {
+		lockprof_longhold(&lock->lk_prof);
+	}
+#endif
+	if (lock->lk_waiters > 0 ||
+	    curthread->t_inherited != THREAD_NO_INHERIT) {
+		spinlock_acquire(&lock_pi_lock);
+		lock->lk_owner = NULL;
+		if (curthread->t_inherited != THREAD_NO_INHERIT) {
+			/* Give back what this lock's waiters lent us. */
+			lock_reinherit();
+		}
+		spinlock_release(&lock_pi_lock);
+	}
+	else {
+		lock->lk_owner = NULL;
+	}
+	wchan_wakeone(lock->lk_wchan);
+	spinlock_release(&lock->lk_lock);
 }
 
 bool
 lock_do_i_hold(struct lock *lock)
 {
-        // Write this
+	KASSERT(lock != NULL);
 
-        (void)lock;  // suppress warning until code gets written
-
-        return true; // dummy until code gets written
+	/* Only we can set lk_owner to curthread, so no need to lock. */
+	return lock->lk_owner == curthread;
 }
 
 ////////////////////////////////////////////////////////////
@@ -225,9 +564,14 @@ cv_create(const char *name)
                 kfree(cv);
                 return NULL;
         }
-        
-        // add stuff here as needed
-        
+
+        cv->cv_wchan = wchan_create(cv->cv_name);
+        if (cv->cv_wchan == NULL) {
+                kfree(cv->cv_name);
+                kfree(cv);
+                return NULL;
+        }
+
         return cv;
 }
 
@@ -236,8 +580,8 @@ cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
 
-        // add stuff here as needed
-        
+        /* wchan_cleanup will assert if anyone's waiting on it */
+        wchan_destroy(cv->cv_wchan);
         kfree(cv->cv_name);
         kfree(cv);
 }
@@ -245,23 +589,254 @@ cv_destroy(struct cv *cv)
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
-        // Write this
-        (void)cv;    // suppress warning until code gets written
-        (void)lock;  // suppress warning until code gets written
+	KASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	/*
+	 * Lock the wchan before releasing the lock, so a signal sent
+	 * by whoever gets the lock next can't be lost.
+	 *
+	 * We might be woken from the CV's wchan by cv_signal, or, if
+	 * cv_broadcast moved us, from the lock's wchan by
+	 * lock_release. Either way we just go get the lock. In the
+	 * second case it is usually free, but someone else can still
+	 * get there first, in which case lock_acquire queues us
+	 * again.
+	 */
+	wchan_lock(cv->cv_wchan);
+	lock_release(lock);
+	wchan_sleep(cv->cv_wchan);
+	lock_acquire(lock);
 }
 
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
-        // Write this
-	(void)cv;    // suppress warning until code gets written
-	(void)lock;  // suppress warning until code gets written
+	KASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	wchan_wakeone(cv->cv_wchan);
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
-	// Write this
-	(void)cv;    // suppress warning until code gets written
-	(void)lock;  // suppress warning until code gets written
+	unsigned moved;
+	int best;
+
+	KASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	/*
+	 * Wait morphing: rather than waking everyone only to have
+	 * them all block on the lock we hold, put them on the lock's
+	 * wchan. Each lock_release then lets exactly one through.
+	 * They're waiting for our lock now, so mark them blocked on
+	 * it and lend us their priority, just as lock_acquire would
+	 * have; when they wake up lock_acquire carries on from there.
+	 */
+	spinlock_acquire(&lock->lk_lock);
+	spinlock_acquire(&lock_pi_lock);
+	moved = wchan_requeue(cv->cv_wchan, lock->lk_wchan, lock, &best);
+	if (moved > 0) {
+		lock->lk_waiters += moved;
+		lock_donate(lock, best);
+	}
+	spinlock_release(&lock_pi_lock);
+	spinlock_release(&lock->lk_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(struct rwlock));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_readwchan = wchan_create(rw->rw_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_writewchan = wchan_create(rw->rw_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_writerswaiting = 0;
+	rw->rw_writer = NULL;
+	rw->rw_upgrader = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_writerswaiting == 0);
+
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+/*
+ * Sleep on WC, releasing the rwlock's spinlock meanwhile. As in P(),
+ * the wchan is locked first so a wakeup can't get lost.
+ */
+static
+void
+rwlock_sleep(struct rwlock *rw, struct wchan *wc)
+{
+	wchan_lock(wc);
+	spinlock_release(&rw->rw_lock);
+	wchan_sleep(wc);
+	spinlock_acquire(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	/* Writer preference: wait behind any writer, even one waiting. */
+	while (rw->rw_writer != NULL || rw->rw_writerswaiting > 0 ||
+	       rw->rw_upgrader != NULL) {
+		rwlock_sleep(rw, rw->rw_readwchan);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0) {
+		/* Let a writer in. */
+		wchan_wakeone(rw->rw_writewchan);
+	}
+	else if (rw->rw_readers == 1 && rw->rw_upgrader != NULL) {
+		/*
+		 * Only the upgrader is left. It's on the same wchan
+		 * as the writers, so wake them all; the writers will
+		 * go back to sleep.
+		 */
+		wchan_wakeall(rw->rw_writewchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	rw->rw_writerswaiting++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		rwlock_sleep(rw, rw->rw_writewchan);
+	}
+	rw->rw_writerswaiting--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_writer == curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	rw->rw_writer = NULL;
+	if (rw->rw_writerswaiting > 0) {
+		wchan_wakeone(rw->rw_writewchan);
+	}
+	else {
+		wchan_wakeall(rw->rw_readwchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_upgrade(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_upgrader == NULL);
+
+	/*
+	 * New readers hold off while rw_upgrader is set, and writers
+	 * can't get in while we're still a reader, so we're next.
+	 */
+	rw->rw_upgrader = curthread;
+	while (rw->rw_readers > 1) {
+		rwlock_sleep(rw, rw->rw_writewchan);
+	}
+	rw->rw_upgrader = NULL;
+	rw->rw_readers = 0;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_downgrade(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_writer == curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	rw->rw_writer = NULL;
+	rw->rw_readers = 1;
+	if (rw->rw_writerswaiting == 0) {
+		/* Other readers may come in with us. */
+		wchan_wakeall(rw->rw_readwchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	return rw->rw_writer == curthread;
 }
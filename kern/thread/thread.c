@@ -47,6 +47,7 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <clock.h>
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
@@ -57,6 +58,46 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/*
+ * Scheduler tuning; see schedule() below. These should be tuned
+ * along with the timing constants in clock.h.
+ *
+ * There are SCHED_NLEVELS priority levels, 0 being the highest. A
+ * thread at level L gets a time slice of SCHED_QUANTUM(L) hardclocks.
+ * A thread that waits SCHED_AGE_HARDCLOCKS on a run queue without
+ * getting to run is promoted a level so it can't be starved.
+ *
+ * SCHED_MIGRATE_COST is the number of hardclocks a thread has to
+ * have been off its last cpu before we assume its cache footprint
+ * there has gone cold and it's worth migrating. Raise it to keep
+ * threads on their cpus more; 0 migrates anything.
+ */
+#define SCHED_NLEVELS		4
+#define SCHED_QUANTUM(level)	(1U << (level))
+#define SCHED_AGE_HARDCLOCKS	64
+#define SCHED_MIGRATE_COST	2
+
+/*
+ * Real-time threads (thread_fork_rt) use the negative priority levels
+ * -THREAD_RT_NPRIO to -1, so they sort ahead of all normal threads.
+ * Their priority is fixed: aging and boosting never go below level 0,
+ * and thread_timeslice doesn't demote them.
+ */
+#define SCHED_RT_PRIORITY(rtprio)	((rtprio) - THREAD_RT_NPRIO)
+#define SCHED_IS_RT(t)			((t)->t_priority < 0)
+
+/*
+ * Number of exited threads (with their stacks) each cpu keeps around
+ * for thread_fork to reuse instead of going to kmalloc.
+ */
+#define THREAD_CACHE_MAX	16
+
+/*
+ * Number of zombies reaped per context switch. The rest are left for
+ * later switches, or for when the cpu has nothing else to do.
+ */
+#define EXORCISE_BATCH		4
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -64,11 +105,32 @@ struct wchan {
 	struct spinlock wc_lock;	/* lock for mutual exclusion */
 };
 
+/*
+ * Timed sleep queue, for thread_sleep_until.
+ *
+ * Timed sleepers sleep on the timedsleep wchan like any other, but
+ * that is only somewhere to sleep: it's in no particular order. The
+ * order is kept by timeheap, a binary min-heap of the same threads
+ * keyed on t_wakeup, so the earliest is always timeheap[0] and
+ * going to sleep costs O(log n) rather than a walk of everyone
+ * already asleep. Both are protected by the wchan's lock. The heap
+ * array is doubled as needed, and never shrinks.
+ */
+static struct wchan *timedsleep;
+static struct thread **timeheap;
+static unsigned timeheap_num, timeheap_max;
+
 /* Master array of CPUs. */
 DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
 static struct cpuarray allcpus;
 
+/*
+ * Whether to do time accounting in thread_switch. This is turned on
+ * once the clock device has been found.
+ */
+static bool thread_accounting;
+
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
@@ -112,38 +174,81 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Time of day in nanoseconds, for accounting.
  */
 static
-struct thread *
-thread_create(const char *name)
+uint64_t
+thread_clock(void)
 {
-	struct thread *thread;
+	time_t secs;
+	uint32_t nsecs;
 
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+/*
+ * Set up a thread structure, either freshly allocated or taken from
+ * the thread cache, and put it on C's list of threads. Doesn't touch
+ * t_stack. Returns ENOMEM on failure, in which case nothing needs to
+ * be undone.
+ */
+static
+int
+thread_init(struct thread *thread, const char *name, struct cpu *c)
+{
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
+	if (strlen(name) < sizeof(thread->t_namebuf)) {
+		strcpy(thread->t_namebuf, name);
+		thread->t_name = thread->t_namebuf;
+	}
+	else {
+		thread->t_name = kstrdup(name);
+		if (thread->t_name == NULL) {
+			return ENOMEM;
+		}
 	}
 
-	thread->t_name = kstrdup(name);
-	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+	/* Put it on C's list of threads, for thread_printstats. */
+	spinlock_acquire(&c->c_allthreads_lock);
+	thread->t_allcpu = c;
+	thread->t_allnext = c->c_allthreads;
+	thread->t_allprevp = &c->c_allthreads;
+	if (c->c_allthreads != NULL) {
+		c->c_allthreads->t_allprevp = &thread->t_allnext;
 	}
+	c->c_allthreads = thread;
+	spinlock_release(&c->c_allthreads_lock);
+
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
+	thread->t_inboxnext = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 
+	/* Scheduler fields; new threads start at the top level */
+	thread->t_priority = 0;
+	thread->t_inherited = THREAD_NO_INHERIT;
+	thread->t_blockedon = NULL;
+	thread->t_heldlocks = NULL;
+	thread->t_ticks = 0;
+	thread->t_waitticks = 0;
+	thread->t_lastcpu = NULL;
+	thread->t_lastrun = 0;
+	thread->t_wakeup.tv_sec = 0;
+	thread->t_wakeup.tv_nsec = 0;
+	thread->t_stamp = 0;
+	thread->t_runtime = 0;
+	thread->t_waittime = 0;
+	thread->t_nvswitch = 0;
+	thread->t_nivswitch = 0;
+
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
@@ -151,6 +256,69 @@ thread_create(const char *name)
 
 	/* If you add to struct thread, be sure to initialize here */
 
+	return 0;
+}
+
+/*
+ * Undo thread_init. Leaves t_stack alone.
+ */
+static
+void
+thread_fini(struct thread *thread)
+{
+	struct cpu *c = thread->t_allcpu;
+
+	spinlock_acquire(&c->c_allthreads_lock);
+	*thread->t_allprevp = thread->t_allnext;
+	if (thread->t_allnext != NULL) {
+		thread->t_allnext->t_allprevp = thread->t_allprevp;
+	}
+	spinlock_release(&c->c_allthreads_lock);
+	thread->t_allcpu = NULL;
+	thread->t_allnext = NULL;
+	thread->t_allprevp = NULL;
+
+	/*
+	 * If you add things to struct thread, be sure to clean them up
+	 * either here or in thread_exit(). (And not both...)
+	 */
+
+	/* Thread subsystem fields */
+	KASSERT(thread->t_proc == NULL);
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+
+	/* sheer paranoia */
+	thread->t_wchan_name = "DESTROYED";
+
+	if (thread->t_name != thread->t_namebuf) {
+		kfree(thread->t_name);
+	}
+	thread->t_name = NULL;
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads. C is the cpu
+ * whose list of threads it goes on.
+ */
+static
+struct thread *
+thread_create(const char *name, struct cpu *c)
+{
+	struct thread *thread;
+
+	thread = kmalloc(sizeof(*thread));
+	if (thread == NULL) {
+		return NULL;
+	}
+	thread->t_stack = NULL;
+
+	if (thread_init(thread, name, c)) {
+		kfree(thread);
+		return NULL;
+	}
+
 	return thread;
 }
 
@@ -179,13 +347,25 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadcache);
 	c->c_hardclocks = 0;
+	c->c_nswitch = 0;
+	c->c_idletime = 0;
+	c->c_nreaped = 0;
+	c->c_reaptime = 0;
+	c->c_reapmax = 0;
 
 	c->c_isidle = false;
+	c->c_tickless = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_inbox = 0;
+	c->c_allthreads = NULL;
+	spinlock_init(&c->c_allthreads_lock);
 
 	c->c_ipi_pending = 0;
+	c->c_ipi_sent = 0;
+	c->c_ipi_coalesced = 0;
 	c->c_numshootdown = 0;
 	spinlock_init(&c->c_ipi_lock);
 
@@ -195,7 +375,7 @@ cpu_create(unsigned hardware_number)
 	}
 
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
-	c->c_curthread = thread_create(namebuf);
+	c->c_curthread = thread_create(namebuf, c);
 	if (c->c_curthread == NULL) {
 		panic("cpu_create: thread_create failed\n");
 	}
@@ -242,42 +422,126 @@ thread_destroy(struct thread *thread)
 	KASSERT(thread != curthread);
 	KASSERT(thread->t_state != S_RUN);
 
-	/*
-	 * If you add things to struct thread, be sure to clean them up
-	 * either here or in thread_exit(). (And not both...)
-	 */
-
-	/* Thread subsystem fields */
-	KASSERT(thread->t_proc == NULL);
+	thread_fini(thread);
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
-	threadlistnode_cleanup(&thread->t_listnode);
-	thread_machdep_cleanup(&thread->t_machdep);
+	kfree(thread);
+}
 
-	/* sheer paranoia */
-	thread->t_wchan_name = "DESTROYED";
+/*
+ * Thread cache.
+ *
+ * Rather than freeing exited threads, exorcise() keeps up to
+ * THREAD_CACHE_MAX of them per cpu, stack and all, for thread_fork
+ * to reuse. This saves three kmallocs and three kfrees per thread,
+ * which adds up for fork-heavy workloads and takes pressure off the
+ * kmalloc lock.
+ *
+ * The cache is only touched by its own cpu, with interrupts off, so
+ * it needs no lock.
+ */
 
-	kfree(thread->t_name);
-	kfree(thread);
+/*
+ * Try to put a dead thread in the cache. Returns false if it can't be
+ * cached and should be destroyed instead.
+ */
+static
+bool
+thread_cache_put(struct thread *thread)
+{
+	int spl;
+	bool ret;
+
+	KASSERT(thread != curthread);
+	KASSERT(thread->t_state == S_ZOMBIE);
+
+	/* Threads without stacks (cpu boot threads) aren't any use. */
+	if (thread->t_stack == NULL) {
+		return false;
+	}
+
+	spl = splhigh();
+	ret = curcpu->c_threadcache.tl_count < THREAD_CACHE_MAX;
+	if (ret) {
+		thread_fini(thread);
+		threadlistnode_init(&thread->t_listnode, thread);
+		threadlist_addhead(&curcpu->c_threadcache, thread);
+	}
+	splx(spl);
+	return ret;
+}
+
+/*
+ * Get a thread with a stack from the cache and set it up, or return
+ * NULL if the cache is empty or setting it up failed.
+ */
+static
+struct thread *
+thread_cache_get(const char *name)
+{
+	struct thread *thread;
+	int spl;
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadcache);
+	splx(spl);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	KASSERT(thread->t_stack != NULL);
+	if (thread_init(thread, name, curcpu->c_self)) {
+		kfree(thread->t_stack);
+		kfree(thread);
+		return NULL;
+	}
+	return thread;
 }
 
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
  * need to have thread_destroy called on them.)
  *
- * The list of zombies is per-cpu.
+ * The list of zombies is per-cpu. At most MAX of them are cleaned up,
+ * so that a burst of exits doesn't put an unbounded amount of kfree
+ * work on the context switch path; thread_switch calls this with
+ * EXORCISE_BATCH and drains the rest when the cpu goes idle.
+ *
+ * Must be called with interrupts off. Stops at curthread, which is
+ * on the list (at the tail) if it's in the middle of exiting.
  */
 static
 void
-exorcise(void)
+exorcise(unsigned max)
 {
 	struct thread *z;
+	uint64_t latency;
+	unsigned n;
 
-	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
-		KASSERT(z != curthread);
+	for (n = 0; n < max; n++) {
+		z = threadlist_remhead(&curcpu->c_zombies);
+		if (z == NULL) {
+			break;
+		}
+		if (z == curthread) {
+			threadlist_addhead(&curcpu->c_zombies, z);
+			break;
+		}
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+
+		if (thread_accounting && z->t_stamp != 0) {
+			latency = thread_clock() - z->t_stamp;
+			curcpu->c_reaptime += latency;
+			if (latency > curcpu->c_reapmax) {
+				curcpu->c_reapmax = latency;
+			}
+		}
+		curcpu->c_nreaped++;
+
+		if (!thread_cache_put(z)) {
+			thread_destroy(z);
+		}
 	}
 }
 
@@ -306,6 +570,7 @@ thread_panic(void)
 	curcpu->c_runqueue.tl_count = 0;
 	curcpu->c_runqueue.tl_head.tln_next = NULL;
 	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	curcpu->c_inbox = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -380,6 +645,11 @@ thread_bootstrap(void)
 	/* cpu_create() should have set t_proc. */
 	KASSERT(curthread->t_proc != NULL);
 
+	timedsleep = wchan_create("timedsleep");
+	if (timedsleep == NULL) {
+		panic("Couldn't create timed sleep queue\n");
+	}
+
 	/* Done */
 }
 
@@ -416,6 +686,10 @@ thread_start_cpus(void)
 
 	kprintf("cpu0: %s\n", cpu_identify());
 
+	/* The clock is available now; start keeping time. */
+	curthread->t_stamp = thread_clock();
+	thread_accounting = true;
+
 	cpu_startup_sem = sem_create("cpu_hatch", 0);
 	mainbus_start_cpus();
 	
@@ -426,17 +700,193 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Insert a thread into a cpu's run queue. The run queue is kept
+ * sorted by priority; the thread goes behind every other thread of
+ * the same or better priority, so threads at the same level run
+ * round-robin.
+ *
+ * The run queue lock of the cpu must be held.
+ */
+static
+void
+runqueue_insert(struct cpu *c, struct thread *t)
+{
+	struct threadlistnode *tln;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (tln = c->c_runqueue.tl_tail.tln_prev;
+	     tln->tln_prev != NULL;
+	     tln = tln->tln_prev) {
+		if (thread_priority(tln->tln_self) <= thread_priority(t)) {
+			threadlist_insertafter(&c->c_runqueue,
+					       tln->tln_self, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+}
+
+/*
+ * Pick a thread on a cpu's run queue to move to another cpu, remove
+ * it from the run queue, and return it. Returns NULL if there's
+ * nothing suitable.
+ *
+ * We take the thread that has been off the cpu longest, on the theory
+ * that its cache footprint is the most likely to have been evicted
+ * already, and refuse to take anything that ran within the last
+ * SCHED_MIGRATE_COST hardclocks. Threads that have never run have no
+ * cache footprint anywhere and are always fair game.
+ *
+ * Ordinarily, the cpu's curthread will not appear on its run queue.
+ * However, it can under the following circumstances:
+ *   - it went to sleep;
+ *   - the processor became idle, so it remained curthread;
+ *   - it was reawakened, so it was put on the run queue;
+ *   - and the processor hasn't fully unidled yet, so all these
+ *     things are still true.
+ *
+ * *Migrating* curthread in this state can cause bad things to happen
+ * (Exercise: Why? And what?) so it is never picked.
+ *
+ * runqueue_find_migratable only looks; runqueue_pick_migratable also
+ * takes the thread off the run queue. The run queue lock of the cpu
+ * must be held.
+ */
+static
+struct thread *
+runqueue_find_migratable(struct cpu *c)
+{
+	struct threadlistnode *tln;
+	struct thread *t, *best;
+	unsigned age, bestage;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	best = NULL;
+	bestage = 0;
+	for (tln = c->c_runqueue.tl_head.tln_next;
+	     tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		t = tln->tln_self;
+		if (t == c->c_curthread) {
+			continue;
+		}
+		if (t->t_lastcpu == NULL) {
+			best = t;
+			break;
+		}
+		/* Unlocked read of t_lastcpu's clock; only a hint. */
+		age = t->t_lastcpu->c_hardclocks - t->t_lastrun;
+		if (age >= SCHED_MIGRATE_COST &&
+		    (best == NULL || age > bestage)) {
+			best = t;
+			bestage = age;
+		}
+	}
+	return best;
+}
+
+static
+struct thread *
+runqueue_pick_migratable(struct cpu *c)
+{
+	struct thread *t;
+
+	t = runqueue_find_migratable(c);
+	if (t != NULL) {
+		threadlist_remove(&c->c_runqueue, t);
+	}
+	return t;
+}
+
+/*
+ * Wakeup inbox.
+ *
+ * Waking a thread that lives on another cpu would otherwise mean
+ * taking that cpu's run queue lock, so a wchan_wakeall on a busy
+ * channel turns into a convoy on the run queue locks of every cpu
+ * involved, each of which the owner also needs on every context
+ * switch. Instead, remote wakers push the thread onto the target
+ * cpu's c_inbox with compare-and-swap and the target moves the
+ * contents to its run queue itself, whenever it next has the run
+ * queue locked anyway: in thread_switch, in the idle loop, at
+ * hardclock, and on IPI_UNIDLE. Any cpu may push; only the owner
+ * removes, and it takes the whole list at once, so there's no ABA
+ * problem.
+ *
+ * An idle or tickless owner won't come looking on its own, so after
+ * pushing, the waker checks c_isidle and c_tickless and sends an IPI
+ * if either is set. The owner sets those flags before its last look
+ * at the inbox. Since each side stores first and loads second, at
+ * least one of them sees the other's store. (This assumes loads
+ * aren't performed ahead of earlier stores, which is true of
+ * System/161.)
+ *
+ * The inbox holds a struct thread pointer in a spinlock_data_t so it
+ * can use the MD atomic operations.
+ */
+static
+void
+inbox_push(struct cpu *c, struct thread *t)
+{
+	spinlock_data_t old;
+
+	COMPILE_ASSERT(sizeof(spinlock_data_t) == sizeof(struct thread *));
+
+	do {
+		old = spinlock_data_get(&c->c_inbox);
+		t->t_inboxnext = (struct thread *)(uintptr_t)old;
+	} while (spinlock_data_compareswap(&c->c_inbox, old,
+					   (uintptr_t)t) != old);
+}
+
+bool
+thread_inbox_drain(void)
+{
+	spinlock_data_t old;
+	struct thread *t, *next, *list;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	do {
+		old = spinlock_data_get(&curcpu->c_inbox);
+		if (old == 0) {
+			return false;
+		}
+	} while (spinlock_data_compareswap(&curcpu->c_inbox, old, 0) != old);
+
+	/* It's a stack; reverse it so threads go in in wakeup order. */
+	list = NULL;
+	for (t = (struct thread *)(uintptr_t)old; t != NULL; t = next) {
+		next = t->t_inboxnext;
+		t->t_inboxnext = list;
+		list = t;
+	}
+	for (t = list; t != NULL; t = next) {
+		next = t->t_inboxnext;
+		t->t_inboxnext = NULL;
+		KASSERT(t->t_cpu == curcpu->c_self);
+		runqueue_insert(curcpu->c_self, t);
+	}
+	return true;
+}
+
 /*
  * Make a thread runnable.
  *
- * targetcpu might be curcpu; it might not be, too. 
+ * targetcpu might be curcpu; it might not be, too. If it isn't, and
+ * we don't already hold its run queue lock, the thread goes through
+ * its inbox instead.
  */
 static
 void
 thread_make_runnable(struct thread *target, bool already_have_lock)
 {
 	struct cpu *targetcpu;
-	bool isidle;
+	bool isidle, tickless, unidle, kick;
+	int spl;
 
 	/* Lock the run queue of the target thread's cpu. */
 	targetcpu = target->t_cpu;
@@ -446,66 +896,249 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
 	}
 	else {
+		/*
+		 * It starts waiting to run now. (thread_switch
+		 * stamps threads that yield itself.)
+		 */
+		if (thread_accounting) {
+			target->t_stamp = thread_clock();
+		}
+
+		/* Stay on this cpu while deciding. */
+		spl = splhigh();
+		if (targetcpu != curcpu->c_self) {
+			inbox_push(targetcpu, target);
+			if (targetcpu->c_isidle || targetcpu->c_tickless) {
+				ipi_send(targetcpu, IPI_UNIDLE);
+			}
+			splx(spl);
+			return;
+		}
+		splx(spl);
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
-	if (isidle) {
+	tickless = targetcpu->c_tickless;
+	runqueue_insert(targetcpu, target);
+	unidle = false;
+	kick = false;
+	if (targetcpu == curcpu->c_self) {
 		/*
-		 * Other processor is idle; send interrupt to make
-		 * sure it unidles.
+		 * We're either about to pick it up in thread_switch
+		 * or it needs the hardclock to preempt whatever's
+		 * running now. In the latter case it has to wait,
+		 * so see if an idle cpu will take it instead.
 		 */
-		ipi_send(targetcpu, IPI_UNIDLE);
+		hardclock_start();
+		kick = !already_have_lock && !isidle;
+	}
+	else if (isidle || tickless) {
+		/*
+		 * Other processor is idle, or busy without a
+		 * hardclock; send interrupt to make sure it unidles
+		 * or restarts its hardclock.
+		 */
+		unidle = true;
 	}
 
+	/*
+	 * Send the interrupt after dropping the run queue lock if we
+	 * can, so the other cpu doesn't wake up only to spin on it.
+	 * (Sending it late is harmless; the target can't go idle
+	 * without first looking at its run queue.)
+	 */
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
 	}
+	if (unidle) {
+		ipi_send(targetcpu, IPI_UNIDLE);
+	}
+	if (kick) {
+		thread_kick_idle();
+	}
 }
 
 /*
- * Create a new thread based on an existing one.
+ * Work stealing.
  *
- * The new thread has name NAME, and starts executing in function
- * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
+ * This is called by a cpu that has run out of things to do, before it
+ * goes idle. Pick the other cpu with the longest run queue and take a
+ * thread from it, as chosen by runqueue_pick_migratable; if it has
+ * nothing that may move, try the other cpus with threads waiting, so
+ * that a cpu kicked by thread_kick_idle finds what it was woken for.
+ * The thread is reassigned to the current cpu and returned; it is not
+ * on any run queue. Returns NULL if there was nothing to take.
  *
- * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * The run queue lengths are read without locking, so the choice of
+ * victim is only a guess; that's all right, since it only matters
+ * for performance. We only ever hold one run queue lock at a time,
+ * and the victim's only long enough to unlink one thread, so a busy
+ * cpu is never held up for long by idle ones.
+ *
+ * Call with interrupts off and without holding any run queue lock.
  */
-int
-thread_fork(const char *name,
-	    struct proc *proc,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2)
+static
+struct thread *
+thread_steal_from(struct cpu *victim)
 {
-	struct thread *newthread;
-	int result;
-
-#ifdef UW
-	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
-#endif // UW
+	struct thread *t;
 
-	newthread = thread_create(name);
-	if (newthread == NULL) {
-		return ENOMEM;
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = runqueue_pick_migratable(victim);
+	if (t != NULL) {
+		t->t_cpu = curcpu->c_self;
 	}
+	spinlock_release(&victim->c_runqueue_lock);
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+	if (t != NULL) {
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u\n",
+		      t->t_name, victim->c_number, curcpu->c_number);
 	}
-	thread_checkstack_init(newthread);
+	return t;
+}
 
-	/*
+static
+struct thread *
+thread_steal(void)
+{
+	unsigned i, numcpus, count, maxcount;
+	struct cpu *c, *victim;
+	struct thread *t;
+
+	victim = NULL;
+	maxcount = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		count = c->c_runqueue.tl_count;
+		if (count > maxcount) {
+			maxcount = count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	t = thread_steal_from(victim);
+	for (i=0; t == NULL && i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self || c == victim ||
+		    c->c_runqueue.tl_count == 0) {
+			continue;
+		}
+		t = thread_steal_from(c);
+	}
+	return t;
+}
+
+/*
+ * An idle cpu stops its hardclock, and only tries thread_steal again
+ * when something wakes it, so a cpu with threads waiting has to go
+ * and get it. One is enough; if there's more to take, we'll be back.
+ *
+ * Only do it if one of our threads could actually be stolen. Until
+ * they've been off the cpu for SCHED_MIGRATE_COST hardclocks they
+ * can't, and waking an idle cpu every tick only for it to find that
+ * out would undo the point of stopping its hardclock.
+ *
+ * c_isidle is read without locking, since an idle cpu woken for
+ * nothing just goes back to sleep.
+ */
+void
+thread_kick_idle(void)
+{
+	unsigned i, numcpus;
+	struct cpu *c;
+	bool stealable;
+	int spl;
+
+	/* Stay on this cpu while looking. */
+	spl = splhigh();
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	stealable = runqueue_find_migratable(curcpu->c_self) != NULL;
+	spinlock_release(&curcpu->c_runqueue_lock);
+	if (!stealable) {
+		splx(spl);
+		return;
+	}
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			break;
+		}
+	}
+	splx(spl);
+}
+
+/*
+ * Compare two times of day: true if A is at or before B.
+ */
+static
+bool
+timespec_le(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec <= b->tv_nsec);
+}
+
+/*
+ * Create a new thread based on an existing one.
+ *
+ * The new thread has name NAME, and starts executing in function
+ * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT. It starts at
+ * scheduler priority level PRIORITY.
+ *
+ * The new thread is created in the process P. If P is null, the
+ * process is inherited from the caller. It will start on the same CPU
+ * as the caller, unless the scheduler intervenes first.
+ */
+static
+int
+thread_fork_priority(const char *name,
+		     struct proc *proc,
+		     int priority,
+		     void (*entrypoint)(void *data1, unsigned long data2),
+		     void *data1, unsigned long data2)
+{
+	struct thread *newthread;
+	int result;
+
+#ifdef UW
+	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
+#endif // UW
+
+	/* Reuse a dead thread and its stack if we have one */
+	newthread = thread_cache_get(name);
+	if (newthread == NULL) {
+		newthread = thread_create(name, curcpu->c_self);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
+
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+	}
+	thread_checkstack_init(newthread);
+
+	/*
 	 * Now we clone various fields from the parent thread.
 	 */
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_priority = priority;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -534,6 +1167,71 @@ thread_fork(const char *name,
 	return 0;
 }
 
+/*
+ * Create a new normal thread. New threads start at the top level of
+ * the feedback queue.
+ */
+int
+thread_fork(const char *name,
+	    struct proc *proc,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2)
+{
+	return thread_fork_priority(name, proc, 0,
+				    entrypoint, data1, data2);
+}
+
+/*
+ * Create a new real-time thread.
+ */
+int
+thread_fork_rt(const char *name,
+	       struct proc *proc,
+	       int rtpriority,
+	       void (*entrypoint)(void *data1, unsigned long data2),
+	       void *data1, unsigned long data2)
+{
+	if (rtpriority < 0 || rtpriority >= THREAD_RT_NPRIO) {
+		return EINVAL;
+	}
+	return thread_fork_priority(name, proc,
+				    SCHED_RT_PRIORITY(rtpriority),
+				    entrypoint, data1, data2);
+}
+
+/*
+ * Change the current thread's scheduling class.
+ */
+int
+thread_set_rtpriority(int rtpriority)
+{
+	bool leaving;
+	int spl;
+
+	if (rtpriority != THREAD_RT_NONE &&
+	    (rtpriority < 0 || rtpriority >= THREAD_RT_NPRIO)) {
+		return EINVAL;
+	}
+
+	/* thread_timeslice looks at these from the timer interrupt. */
+	spl = splhigh();
+	leaving = SCHED_IS_RT(curthread) && rtpriority == THREAD_RT_NONE;
+	if (rtpriority == THREAD_RT_NONE) {
+		curthread->t_priority = 0;
+	}
+	else {
+		curthread->t_priority = SCHED_RT_PRIORITY(rtpriority);
+	}
+	curthread->t_ticks = 0;
+	splx(spl);
+
+	if (leaving) {
+		/* We may have been keeping something better waiting. */
+		thread_yield();
+	}
+	return 0;
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -548,6 +1246,8 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc)
 {
 	struct thread *cur, *next;
+	uint64_t now, then;
+	bool idled;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -570,8 +1270,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
-	/* Lock the run queue. */
+	/* Lock the run queue, and collect any remote wakeups. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
+	thread_inbox_drain();
 
 	/* Micro-optimization: if nothing to do, just return */
 	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
@@ -580,6 +1281,27 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		return;
 	}
 
+	/*
+	 * Charge the current thread for the time it ran. Sleeping
+	 * counts as a voluntary switch; yielding does too unless
+	 * it's being done to us from the timer interrupt.
+	 */
+	now = 0;
+	if (thread_accounting) {
+		now = thread_clock();
+		if (cur->t_stamp != 0) {
+			cur->t_runtime += now - cur->t_stamp;
+		}
+		cur->t_stamp = now;
+	}
+	if (newstate == S_SLEEP ||
+	    (newstate == S_READY && !cur->t_in_interrupt)) {
+		cur->t_nvswitch++;
+	}
+	else if (newstate == S_READY) {
+		cur->t_nivswitch++;
+	}
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -612,6 +1334,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	}
 	cur->t_state = newstate;
 
+	/* Remember where and when it last ran, for cache affinity. */
+	cur->t_lastcpu = curcpu->c_self;
+	cur->t_lastrun = curcpu->c_hardclocks;
+
 	/*
 	 * Get the next thread. While there isn't one, call md_idle().
 	 * curcpu->c_isidle must be true when md_idle is
@@ -629,17 +1355,59 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * lock to look at it, this should not be visible or matter.
 	 */
 
+	/*
+	 * While idle, also stop the hardclock; it has nothing to do.
+	 * Start it again once we have a thread to run.
+	 */
+
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
+	idled = false;
 	do {
+		thread_inbox_drain();
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
+			hardclock_stop();
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/*
+			 * Nothing else to do, so finish reaping any
+			 * zombies left over from earlier switches.
+			 */
+			exorcise(curcpu->c_zombies.tl_count);
+			/*
+			 * Before actually idling, try to steal work
+			 * from another cpu. A stolen thread isn't on
+			 * our run queue; just switch to it directly.
+			 */
+			next = thread_steal();
+			if (next == NULL) {
+				cpu_idle();
+				idled = true;
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	hardclock_start();
+
+	/* It's no longer waiting, so it no longer needs aging. */
+	next->t_waitticks = 0;
+
+	/* Charge idle time to the cpu and wait time to the thread. */
+	if (thread_accounting) {
+		if (idled) {
+			then = thread_clock();
+			curcpu->c_idletime += then - now;
+			now = then;
+		}
+		if (next->t_stamp != 0) {
+			next->t_waittime += now - next->t_stamp;
+		}
+		next->t_stamp = now;
+	}
+	if (next != cur) {
+		curcpu->c_nswitch++;
+	}
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -711,8 +1479,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Activate our address space in the MMU. */
 	as_activate();
 
-	/* Clean up dead threads. */
-	exorcise();
+	/* Clean up some dead threads. */
+	exorcise(EXORCISE_BATCH);
 
 	/* Turn interrupts back on. */
 	splx(spl);
@@ -744,8 +1512,8 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Activate our address space in the MMU. */
 	as_activate();
 
-	/* Clean up dead threads. */
-	exorcise();
+	/* Clean up some dead threads. */
+	exorcise(EXORCISE_BATCH);
 
 	/* Enable interrupts. */
 	spl0();
@@ -826,13 +1594,171 @@ thread_yield(void)
  * the current CPU's run queue by job priority.
  */
 
+/*
+ * The policy is a multilevel feedback queue:
+ *
+ *    - Each cpu's run queue is kept sorted by priority level (see
+ *      runqueue_insert) so the best thread is always at the head.
+ *
+ *    - thread_timeslice() charges the running thread each hardclock.
+ *      A thread that uses up its whole time slice is CPU-bound and
+ *      gets demoted a level, which also doubles its next slice.
+ *
+ *    - A thread waking up from a wait channel was blocked rather
+ *      than computing, so it gets promoted a level (thread_boost).
+ *      Interactive and I/O-bound threads thus float to the top and
+ *      preempt CPU hogs as soon as they become runnable.
+ *
+ *    - Here, threads that have sat on the run queue for
+ *      SCHED_AGE_HARDCLOCKS without running are promoted a level,
+ *      so that a steady stream of high-priority threads can't
+ *      starve the rest forever.
+ *
+ *    - Real-time threads sit above all of this at fixed levels
+ *      below 0 and are dispatched first-in first-out within a level.
+ *      Nothing ages normal threads into the real-time levels.
+ */
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct threadlist aged;
+	struct thread *t;
+	bool changed;
+
+	threadlist_init(&aged);
+	changed = false;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	while ((t = threadlist_remhead(&curcpu->c_runqueue)) != NULL) {
+		t->t_waitticks += SCHEDULE_HARDCLOCKS;
+		if (t->t_waitticks >= SCHED_AGE_HARDCLOCKS &&
+		    t->t_priority > 0) {
+			t->t_priority--;
+			t->t_waitticks = 0;
+			changed = true;
+		}
+		threadlist_addtail(&aged, t);
+	}
+	while ((t = threadlist_remhead(&aged)) != NULL) {
+		if (changed) {
+			runqueue_insert(curcpu, t);
+		}
+		else {
+			threadlist_addtail(&curcpu->c_runqueue, t);
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	threadlist_cleanup(&aged);
+}
+
+/*
+ * Time slice accounting, from hardclock().
+ *
+ * Note that we come here in interrupt context on the thread that was
+ * interrupted; if the cpu is idle, there's no thread to charge.
+ */
+void
+thread_timeslice(void)
+{
+	struct thread *cur, *best;
+	bool preempt;
+
+	if (curcpu->c_isidle) {
+		return;
+	}
+
+	cur = curthread;
+	cur->t_ticks++;
+	if (!SCHED_IS_RT(cur) &&
+	    cur->t_ticks >= SCHED_QUANTUM(cur->t_priority)) {
+		/* Used its whole slice; demote it. */
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		preempt = true;
+	}
+	else {
+		/* Preempt early if something better is waiting. */
+		preempt = false;
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		thread_inbox_drain();
+		if (!threadlist_isempty(&curcpu->c_runqueue)) {
+			best = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+			preempt = thread_priority(best) < thread_priority(cur);
+		}
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
+
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * Effective priority, counting inheritance.
+ */
+int
+thread_priority(const struct thread *t)
+{
+	if (t->t_inherited < t->t_priority) {
+		return t->t_inherited;
+	}
+	return t->t_priority;
+}
+
+/*
+ * Change the priority T has inherited. If it's on a run queue, it has
+ * to be moved to its new place there. Look for it rather than going
+ * by t_state: a thread that has been woken but hasn't run yet is on
+ * a run queue still marked S_SLEEP. (If it's in transit between cpus,
+ * or in an inbox, it isn't on any run queue; it'll be put in the
+ * right place when it arrives.)
+ */
+void
+thread_inherit_priority(struct thread *t, int priority)
+{
+	struct cpu *c;
+	struct threadlistnode *tln;
+
+	/* Lock the run queue of whatever cpu it's on right now. */
+	while (1) {
+		c = t->t_cpu;
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (t->t_cpu == c) {
+			break;
+		}
+		spinlock_release(&c->c_runqueue_lock);
+	}
+
+	for (tln = c->c_runqueue.tl_head.tln_next;
+	     tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		if (tln->tln_self == t) {
+			threadlist_remove(&c->c_runqueue, t);
+			t->t_inherited = priority;
+			runqueue_insert(c, t);
+			spinlock_release(&c->c_runqueue_lock);
+			return;
+		}
+	}
+	t->t_inherited = priority;
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+/*
+ * Priority boost for a thread coming off a wait channel. It gets a
+ * fresh time slice, too.
+ */
+static
+void
+thread_boost(struct thread *t)
+{
+	if (t->t_priority > 0) {
+		t->t_priority--;
+	}
+	t->t_ticks = 0;
 }
 
 /*
@@ -848,9 +1774,10 @@ schedule(void)
  * and the performance loss due to underutilization of some CPUs is
  * something that needs to be tuned and probably is workload-specific.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * So we only move threads that have been off the cpu for a while and
+ * prefer the ones that have been off longest; see
+ * runqueue_pick_migratable and SCHED_MIGRATE_COST. Threads that ran
+ * recently stay here even if that leaves the load less balanced.
  */
 void
 thread_consider_migration(void)
@@ -860,6 +1787,7 @@ thread_consider_migration(void)
 	struct cpu *c;
 	struct threadlist victims;
 	struct thread *t;
+	bool unidle;
 
 	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
@@ -882,62 +1810,44 @@ thread_consider_migration(void)
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+		t = runqueue_pick_migratable(curcpu->c_self);
+		if (t == NULL) {
+			break;
+		}
+		threadlist_addtail(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
+	to_send = victims.tl_count;
 
 	for (i=0; i < numcpus && to_send > 0; i++) {
 		c = cpuarray_get(&allcpus, i);
 		if (c == curcpu->c_self) {
 			continue;
 		}
+		unidle = false;
 		spinlock_acquire(&c->c_runqueue_lock);
 		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runqueue_insert(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
 			to_send--;
-			if (c->c_isidle) {
+			if (c->c_isidle || c->c_tickless) {
 				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
+				 * Other processor is idle or not
+				 * ticking; it needs an interrupt to
+				 * make sure it unidles. One will do
+				 * for all the threads we give it.
 				 */
-				ipi_send(c, IPI_UNIDLE);
+				unidle = true;
 			}
 		}
 		spinlock_release(&c->c_runqueue_lock);
+		if (unidle) {
+			ipi_send(c, IPI_UNIDLE);
+		}
 	}
 
 	/*
@@ -948,7 +1858,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_insert(curcpu, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -959,6 +1869,124 @@ thread_consider_migration(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Statistics.
+ */
+
+/* Snapshot of one thread's statistics, for thread_printstats. */
+struct threadstat {
+	char ts_name[16];
+	unsigned ts_cpu;
+	threadstate_t ts_state;
+	int ts_priority;
+	uint64_t ts_runtime;
+	uint64_t ts_waittime;
+	unsigned ts_nvswitch;
+	unsigned ts_nivswitch;
+};
+
+/*
+ * Print a top-style table: the cpus, then every thread in order of
+ * total run time. Times are printed in milliseconds.
+ *
+ * The thread statistics are copied out under the locks first and then
+ * printed, so we don't hold a spinlock across all the kprintfs.
+ */
+void
+thread_printstats(void)
+{
+	static const char *const statenames[] = {
+		"run", "ready", "sleep", "zombie",
+	};
+	struct threadstat *stats, tmp;
+	struct thread *t;
+	struct cpu *c;
+	unsigned i, j, num, max;
+
+	kprintf("cpu   switches  hardclocks   idle(ms)"
+		"   reaped  avgreap(us)  maxreap(us)\n");
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("%3u %10u  %10u %10llu %8u %12llu %12llu\n",
+			c->c_number, c->c_nswitch,
+			c->c_hardclocks, c->c_idletime / 1000000,
+			c->c_nreaped,
+			c->c_nreaped ? c->c_reaptime / c->c_nreaped / 1000 : 0,
+			c->c_reapmax / 1000);
+	}
+	kprintf("\n");
+
+	kprintf("cpu   ipis sent  ipis coalesced\n");
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("%3u %11u %15u\n", c->c_number, c->c_ipi_sent,
+			c->c_ipi_coalesced);
+	}
+	kprintf("\n");
+
+	/* Count them, leaving some room for threads created meanwhile. */
+	max = 8;
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_allthreads_lock);
+		for (t = c->c_allthreads; t != NULL; t = t->t_allnext) {
+			max++;
+		}
+		spinlock_release(&c->c_allthreads_lock);
+	}
+	stats = kmalloc(max * sizeof(*stats));
+	if (stats == NULL) {
+		kprintf("thread_printstats: Out of memory\n");
+		return;
+	}
+
+	/* One cpu's list at a time, so we never hold two of the locks. */
+	num = 0;
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_allthreads_lock);
+		for (t = c->c_allthreads; t != NULL && num < max;
+		     t = t->t_allnext) {
+			snprintf(stats[num].ts_name,
+				 sizeof(stats[num].ts_name), "%s", t->t_name);
+			stats[num].ts_cpu = t->t_cpu ? t->t_cpu->c_number : 0;
+			stats[num].ts_state = t->t_state;
+			stats[num].ts_priority = thread_priority(t);
+			stats[num].ts_runtime = t->t_runtime;
+			stats[num].ts_waittime = t->t_waittime;
+			stats[num].ts_nvswitch = t->t_nvswitch;
+			stats[num].ts_nivswitch = t->t_nivswitch;
+			num++;
+		}
+		spinlock_release(&c->c_allthreads_lock);
+	}
+
+	/* Insertion sort by run time, largest first. */
+	for (i=1; i<num; i++) {
+		tmp = stats[i];
+		for (j=i; j>0 && stats[j-1].ts_runtime < tmp.ts_runtime; j--) {
+			stats[j] = stats[j-1];
+		}
+		stats[j] = tmp;
+	}
+
+	kprintf("%-16s cpu state  pri    run(ms)   wait(ms)"
+		"    vsw   ivsw\n", "thread");
+	for (i=0; i<num; i++) {
+		kprintf("%-16s %3u %-6s %3d %10llu %10llu %6u %6u\n",
+			stats[i].ts_name, stats[i].ts_cpu,
+			statenames[stats[i].ts_state],
+			stats[i].ts_priority,
+			stats[i].ts_runtime / 1000000,
+			stats[i].ts_waittime / 1000000,
+			stats[i].ts_nvswitch, stats[i].ts_nivswitch);
+	}
+
+	kfree(stats);
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * Wait channel functions
  */
@@ -1050,6 +2078,7 @@ wchan_wakeone(struct wchan *wc)
 		return;
 	}
 
+	thread_boost(target);
 	thread_make_runnable(target, false);
 }
 
@@ -1084,12 +2113,273 @@ wchan_wakeall(struct wchan *wc)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_boost(target);
 		thread_make_runnable(target, false);
 	}
 
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Move all threads sleeping on a wait channel to another one. The
+ * threads stay asleep, so unlike wchan_wakeall this never touches a
+ * run queue. Locks WC before TO.
+ */
+unsigned
+wchan_requeue(struct wchan *wc, struct wchan *to, struct lock *blockedon,
+	      int *best)
+{
+	struct thread *target;
+	unsigned count;
+	int p;
+
+	KASSERT(wc != to);
+
+	count = 0;
+	*best = THREAD_NO_INHERIT;
+	spinlock_acquire(&wc->wc_lock);
+	if (!threadlist_isempty(&wc->wc_threads)) {
+		spinlock_acquire(&to->wc_lock);
+		while ((target = threadlist_remhead(&wc->wc_threads))
+		       != NULL) {
+			target->t_wchan_name = to->wc_name;
+			target->t_blockedon = blockedon;
+			threadlist_addtail(&to->wc_threads, target);
+			p = thread_priority(target);
+			if (p < *best) {
+				*best = p;
+			}
+			count++;
+		}
+		spinlock_release(&to->wc_lock);
+	}
+	spinlock_release(&wc->wc_lock);
+
+	return count;
+}
+
+/*
+ * Timed sleep heap operations. Call with timedsleep locked.
+ */
+static
+void
+timeheap_insert(struct thread *t)
+{
+	unsigned i, parent;
+
+	KASSERT(timeheap_num < timeheap_max);
+
+	/* Sift up from the end. */
+	i = timeheap_num++;
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (timespec_le(&timeheap[parent]->t_wakeup, &t->t_wakeup)) {
+			break;
+		}
+		timeheap[i] = timeheap[parent];
+		i = parent;
+	}
+	timeheap[i] = t;
+}
+
+static
+struct thread *
+timeheap_remmin(void)
+{
+	struct thread *min, *last;
+	unsigned i, child;
+
+	KASSERT(timeheap_num > 0);
+
+	min = timeheap[0];
+	last = timeheap[--timeheap_num];
+
+	/* Sift the last one down from the top. */
+	i = 0;
+	while ((child = 2 * i + 1) < timeheap_num) {
+		if (child + 1 < timeheap_num &&
+		    !timespec_le(&timeheap[child]->t_wakeup,
+				 &timeheap[child + 1]->t_wakeup)) {
+			child++;
+		}
+		if (timespec_le(&last->t_wakeup, &timeheap[child]->t_wakeup)) {
+			break;
+		}
+		timeheap[i] = timeheap[child];
+		i = child;
+	}
+	timeheap[i] = last;
+
+	return min;
+}
+
+/*
+ * Make the heap bigger. The allocation is done without the wchan
+ * lock, which every hardclock takes; someone else might grow the
+ * heap meanwhile, in which case ours is thrown away.
+ */
+static
+int
+timeheap_grow(void)
+{
+	struct thread **newheap, **oldheap;
+	unsigned newmax;
+
+	newmax = timeheap_max ? timeheap_max * 2 : 16;
+	newheap = kmalloc(newmax * sizeof(*newheap));
+	if (newheap == NULL) {
+		return ENOMEM;
+	}
+
+	wchan_lock(timedsleep);
+	if (timeheap_max < newmax) {
+		if (timeheap_num > 0) {
+			memcpy(newheap, timeheap,
+			       timeheap_num * sizeof(*newheap));
+		}
+		oldheap = timeheap;
+		timeheap = newheap;
+		timeheap_max = newmax;
+	}
+	else {
+		oldheap = newheap;
+	}
+	wchan_unlock(timedsleep);
+
+	if (oldheap != NULL) {
+		kfree(oldheap);
+	}
+	return 0;
+}
+
+/*
+ * Timed sleep.
+ */
+void
+thread_sleep_until(const struct timespec *wakeup)
+{
+	struct timespec now;
+	time_t secs;
+	uint32_t nsecs;
+
+	/* may not sleep in an interrupt handler */
+	KASSERT(!curthread->t_in_interrupt);
+
+	while (1) {
+		gettime(&secs, &nsecs);
+		now.tv_sec = secs;
+		now.tv_nsec = nsecs;
+		if (timespec_le(wakeup, &now)) {
+			return;
+		}
+
+		wchan_lock(timedsleep);
+		if (timeheap_num < timeheap_max) {
+			break;
+		}
+		wchan_unlock(timedsleep);
+
+		if (timeheap_grow()) {
+			/* No memory for a bigger heap; poll instead. */
+			thread_yield();
+		}
+	}
+
+	curthread->t_wakeup = *wakeup;
+	timeheap_insert(curthread);
+	wchan_sleep(timedsleep);
+}
+
+/*
+ * Wake up the threads at the top of the timed sleep heap whose
+ * wakeup time has come.
+ */
+void
+thread_timed_wakeup(void)
+{
+	struct thread *target;
+	struct threadlist list;
+	struct timespec now;
+	time_t secs;
+	uint32_t nsecs;
+
+	/*
+	 * Check without locking first; this runs on every hardclock
+	 * and the heap is usually empty. Anything we miss will be
+	 * seen next time.
+	 */
+	if (timeheap_num == 0) {
+		return;
+	}
+
+	gettime(&secs, &nsecs);
+	now.tv_sec = secs;
+	now.tv_nsec = nsecs;
+
+	threadlist_init(&list);
+	spinlock_acquire(&timedsleep->wc_lock);
+	while (timeheap_num > 0 &&
+	       timespec_le(&timeheap[0]->t_wakeup, &now)) {
+		target = timeheap_remmin();
+		threadlist_remove(&timedsleep->wc_threads, target);
+		threadlist_addtail(&list, target);
+	}
+	spinlock_release(&timedsleep->wc_lock);
+
+	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_boost(target);
+		thread_make_runnable(target, false);
+	}
+
+	threadlist_cleanup(&list);
+}
+
+/*
+ * Get the earliest timed sleep wakeup time.
+ */
+bool
+thread_next_wakeup(struct timespec *ret)
+{
+	bool found;
+
+	if (timeheap_num == 0) {
+		return false;
+	}
+
+	spinlock_acquire(&timedsleep->wc_lock);
+	found = timeheap_num > 0;
+	if (found) {
+		*ret = timeheap[0]->t_wakeup;
+	}
+	spinlock_release(&timedsleep->wc_lock);
+
+	return found;
+}
+
+/*
+ * Best effective priority of the threads sleeping on the channel.
+ */
+int
+wchan_best_priority(struct wchan *wc)
+{
+	struct threadlistnode *tln;
+	int best, p;
+
+	best = THREAD_NO_INHERIT;
+	spinlock_acquire(&wc->wc_lock);
+	for (tln = wc->wc_threads.tl_head.tln_next;
+	     tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		p = thread_priority(tln->tln_self);
+		if (p < best) {
+			best = p;
+		}
+	}
+	spinlock_release(&wc->wc_lock);
+
+	return best;
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -1112,6 +2402,29 @@ wchan_isempty(struct wchan *wc)
  * Machine-independent IPI handling
  */
 
+/*
+ * Post IPI CODE to TARGET, whose IPI lock must be held. The hardware
+ * interrupt is only raised if nothing was already pending; otherwise
+ * the interrupt that's already on its way will pick up this one too.
+ * This keeps bursts of wakeups (e.g. forking lots of threads) from
+ * turning into an interrupt storm.
+ */
+static
+void
+ipi_post(struct cpu *target, int code)
+{
+	KASSERT(spinlock_do_i_hold(&target->c_ipi_lock));
+
+	if (target->c_ipi_pending != 0) {
+		target->c_ipi_coalesced++;
+	}
+	else {
+		target->c_ipi_sent++;
+		mainbus_send_ipi(target);
+	}
+	target->c_ipi_pending |= (uint32_t)1 << code;
+}
+
 /*
  * Send an IPI (inter-processor interrupt) to the specified CPU.
  */
@@ -1121,8 +2434,7 @@ ipi_send(struct cpu *target, int code)
 	KASSERT(code >= 0 && code < 32);
 
 	spinlock_acquire(&target->c_ipi_lock);
-	target->c_ipi_pending |= (uint32_t)1 << code;
-	mainbus_send_ipi(target);
+	ipi_post(target, code);
 	spinlock_release(&target->c_ipi_lock);
 }
 
@@ -1156,8 +2468,7 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 		target->c_numshootdown = n+1;
 	}
 
-	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-	mainbus_send_ipi(target);
+	ipi_post(target, IPI_TLBSHOOTDOWN);
 
 	spinlock_release(&target->c_ipi_lock);
 }
@@ -1189,7 +2500,8 @@ interprocessor_interrupt(void)
 	if (bits & (1U << IPI_UNIDLE)) {
 		/*
 		 * The cpu has already unidled itself to take the
-		 * interrupt; don't need to do anything else.
+		 * interrupt; don't need to do anything else, except
+		 * restart the hardclock (below).
 		 */
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
@@ -1206,4 +2518,19 @@ interprocessor_interrupt(void)
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	if (bits & (1U << IPI_UNIDLE)) {
+		/*
+		 * If the cpu is busy but had stopped its hardclock,
+		 * something new was put on its run queue or inbox;
+		 * start ticking again so it gets to run. This has to
+		 * wait until the IPI lock is released, because
+		 * thread_make_runnable sends IPIs while holding the
+		 * run queue lock.
+		 */
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		thread_inbox_drain();
+		hardclock_start();
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
 }
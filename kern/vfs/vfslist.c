@@ -87,6 +87,22 @@ DEFARRAY(knowndev, /*no inline*/);
 
 static struct knowndevarray *knowndevs;
 
+/*
+ * Lock for knowndevs and the kd_fs fields in it. Name lookups only
+ * read it, so they can go in parallel; adding devices and mounting
+ * and unmounting write it.
+ *
+ * mount_lock serializes mount and unmount, so at most one thread is
+ * ever upgrading knowndevs_lock.
+ *
+ * Lookups call into the filesystem (FSOP_GETROOT) with knowndevs_lock
+ * held, and filesystems take vfs_biglock internally, so the order is
+ * mount_lock, then knowndevs_lock, then vfs_biglock. Never take
+ * knowndevs_lock while holding the big lock.
+ */
+static struct rwlock *knowndevs_lock;
+static struct lock *mount_lock;
+
 /* The big lock for all FS ops. Remove for filesystem assignment. */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
@@ -103,12 +119,23 @@ vfs_bootstrap(void)
 		panic("vfs: Could not create knowndevs array\n");
 	}
 
+	knowndevs_lock = rwlock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
+	}
+
+	mount_lock = lock_create("vfs_mount");
+	if (mount_lock==NULL) {
+		panic("vfs: Could not create mount lock\n");
+	}
+
 	vfs_biglock = lock_create("vfs_biglock");
 	if (vfs_biglock==NULL) {
 		panic("vfs: Could not create vfs big lock\n");
 	}
 	vfs_biglock_depth = 0;
 
+	vfs_bootfs_bootstrap();
 	devnull_create();
 }
 
@@ -154,7 +181,7 @@ vfs_sync(void)
 	struct knowndev *dev;
 	unsigned i, num;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_read(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -164,23 +191,22 @@ vfs_sync(void)
 		}
 	}
 
-	vfs_biglock_release();
+	rwlock_release_read(knowndevs_lock);
 
 	return 0;
 }
 
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
- * back an appropriate vnode.
+ * back an appropriate vnode. Should already hold knowndevs_lock.
  */
+static
 int
-vfs_getroot(const char *devname, struct vnode **result)
+findroot(const char *devname, struct vnode **result)
 {
 	struct knowndev *kd;
 	unsigned i, num;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -250,6 +276,23 @@ vfs_getroot(const char *devname, struct vnode **result)
 	return ENODEV;
 }
 
+/*
+ * Look up a device or volume name, for path resolution.
+ */
+int
+vfs_getroot(const char *devname, struct vnode **result)
+{
+	int err;
+
+	KASSERT(!vfs_biglock_do_i_hold());
+
+	rwlock_acquire_read(knowndevs_lock);
+	err = findroot(devname, result);
+	rwlock_release_read(knowndevs_lock);
+
+	return err;
+}
+
 /*
  * Given a filesystem, hand back the name of the device it's mounted on.
  */
@@ -257,12 +300,14 @@ const char *
 vfs_getdevname(struct fs *fs)
 {
 	struct knowndev *kd;
+	const char *name;
 	unsigned i, num;
 
 	KASSERT(fs != NULL);
+	KASSERT(!vfs_biglock_do_i_hold());
 
-	KASSERT(vfs_biglock_do_i_hold());
-
+	name = NULL;
+	rwlock_acquire_read(knowndevs_lock);
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -274,11 +319,13 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
-			return kd->kd_name;
+			name = kd->kd_name;
+			break;
 		}
 	}
+	rwlock_release_read(knowndevs_lock);
 
-	return NULL;
+	return name;
 }
 
 /*
@@ -338,7 +385,7 @@ badnames(const char *n1, const char *n2, const char *n3)
 	unsigned i, num;
 	struct knowndev *kd;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -378,8 +425,6 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	unsigned index;
 	int result;
 
-	vfs_biglock_acquire();
-
 	name = kstrdup(dname);
 	if (name==NULL) {
 		goto nomem;
@@ -411,8 +456,10 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		volname = FSOP_GETVOLNAME(fs);
 	}
 
+	rwlock_acquire_write(knowndevs_lock);
+
 	if (badnames(name, rawname, volname)) {
-		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return EEXIST;
 	}
 
@@ -423,7 +470,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		dev->d_devnumber = index+1;
 	}
 
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return result;
 
  nomem:
@@ -441,7 +488,6 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		kfree(kd);
 	}
 	
-	vfs_biglock_release();
 	return ENOMEM;
 }
 
@@ -480,8 +526,6 @@ findmount(const char *devname, struct knowndev **result)
 	unsigned i, num;
 	bool found = false;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	num = knowndevarray_num(knowndevs);
 	for (i=0; !found && i<num; i++) {
 		dev = knowndevarray_get(knowndevs, i);
@@ -514,16 +558,26 @@ vfs_mount(const char *devname, void *data,
 	struct fs *fs;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * Mounting is serialized by mount_lock. Name lookups only
+	 * need to be kept out while the new fs is being attached, so
+	 * do the (slow) mount with a read lock and upgrade for that.
+	 * Holding mount_lock also makes the upgrade safe, since only
+	 * one thread can be trying at a time.
+	 */
+	lock_acquire(mount_lock);
+	rwlock_acquire_read(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_read(knowndevs_lock);
+		lock_release(mount_lock);
 		return result;
 	}
 
 	if (kd->kd_fs != NULL) {
-		vfs_biglock_release();
+		rwlock_release_read(knowndevs_lock);
+		lock_release(mount_lock);
 		return EBUSY;
 	}
 	KASSERT(kd->kd_rawname != NULL);
@@ -531,19 +585,23 @@ vfs_mount(const char *devname, void *data,
 
 	result = mountfunc(data, kd->kd_device, &fs);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_read(knowndevs_lock);
+		lock_release(mount_lock);
 		return result;
 	}
 
 	KASSERT(fs != NULL);
 
+	rwlock_upgrade(knowndevs_lock);
 	kd->kd_fs = fs;
+	rwlock_downgrade(knowndevs_lock);
 
 	volname = FSOP_GETVOLNAME(fs);
 	kprintf("vfs: Mounted %s: on %s\n",
 		volname ? volname : kd->kd_name, kd->kd_name);
 
-	vfs_biglock_release();
+	rwlock_release_read(knowndevs_lock);
+	lock_release(mount_lock);
 	return 0;
 }
 
@@ -557,7 +615,14 @@ vfs_unmount(const char *devname)
 	struct knowndev *kd;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * Unlike mounting, this has to keep lookups out throughout:
+	 * once FSOP_UNMOUNT has succeeded the fs is gone, and a lookup
+	 * that got in before we detach it would call FSOP_GETROOT on
+	 * it.
+	 */
+	lock_acquire(mount_lock);
+	rwlock_acquire_write(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -589,7 +654,8 @@ vfs_unmount(const char *devname)
 	KASSERT(result==0);
 
  fail:
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
+	lock_release(mount_lock);
 	return result;
 }
 
@@ -603,7 +669,9 @@ vfs_unmountall(void)
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	/* As in vfs_unmount, keep lookups out throughout. */
+	lock_acquire(mount_lock);
+	rwlock_acquire_write(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -650,7 +718,8 @@ vfs_unmountall(void)
 		dev->kd_fs = NULL;
 	}
 
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
+	lock_release(mount_lock);
 
 	return 0;
 }
@@ -42,8 +42,30 @@
 
 static struct vnode *bootfs_vnode = NULL;
 
+/*
+ * Path lookups don't hold vfs_biglock, so bootfs_vnode has its own
+ * lock. It has to be a sleep lock: taking a reference to the vnode
+ * takes the big lock. So the order is bootfs_lock, then vfs_biglock.
+ */
+static struct lock *bootfs_lock;
+
+/*
+ * Setup function; called from vfs_bootstrap.
+ */
+void
+vfs_bootfs_bootstrap(void)
+{
+	bootfs_lock = lock_create("bootfs");
+	if (bootfs_lock==NULL) {
+		panic("vfs: Could not create bootfs lock\n");
+	}
+}
+
 /*
  * Helper function for actually changing bootfs_vnode.
+ *
+ * Drop the old one after letting go of the lock; there's no need to
+ * hold it while the vnode is (perhaps) reclaimed.
  */
 static
 void
@@ -51,8 +73,10 @@ change_bootfs(struct vnode *newvn)
 {
 	struct vnode *oldvn;
 
+	lock_acquire(bootfs_lock);
 	oldvn = bootfs_vnode;
 	bootfs_vnode = newvn;
+	lock_release(bootfs_lock);
 
 	if (oldvn != NULL) {
 		VOP_DECREF(oldvn);
@@ -75,14 +99,11 @@ vfs_setbootfs(const char *fsname)
 	int result;
 	struct vnode *newguy;
 
-	vfs_biglock_acquire();
-
 	snprintf(tmp, sizeof(tmp)-1, "%s", fsname);
 	s = strchr(tmp, ':');
 	if (s) {
 		/* If there's a colon, it must be at the end */
 		if (strlen(s)>0) {
-			vfs_biglock_release();
 			return EINVAL;
 		}
 	}
@@ -92,19 +113,16 @@ vfs_setbootfs(const char *fsname)
 
 	result = vfs_chdir(tmp);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	result = vfs_getcurdir(&newguy);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	change_bootfs(newguy);
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -114,9 +132,7 @@ vfs_setbootfs(const char *fsname)
 void
 vfs_clearbootfs(void)
 {
-	vfs_biglock_acquire();
 	change_bootfs(NULL);
-	vfs_biglock_release();
 }
 
 
@@ -133,8 +149,6 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	struct vnode *vn;
 	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/*
 	 * Locate the first colon or slash.
 	 */
@@ -188,11 +202,14 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	KASSERT(colon==0 || slash==0);
 
 	if (path[0]=='/') {
+		lock_acquire(bootfs_lock);
 		if (bootfs_vnode==NULL) {
+			lock_release(bootfs_lock);
 			return ENOENT;
 		}
 		VOP_INCREF(bootfs_vnode);
 		*startvn = bootfs_vnode;
+		lock_release(bootfs_lock);
 	}
 	else {
 		KASSERT(path[0]==':');
@@ -226,6 +243,10 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
+ *
+ * These don't take vfs_biglock. The device table has its own lock,
+ * and the filesystems take the big lock themselves where they need
+ * it, so lookups only serialize inside the fs.
  */
 
 int
@@ -235,11 +256,8 @@ vfs_lookparent(char *path, struct vnode **retval,
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -257,7 +275,6 @@ vfs_lookparent(char *path, struct vnode **retval,
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -267,23 +284,18 @@ vfs_lookup(char *path, struct vnode **retval)
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
 	result = VOP_LOOKUP(startvn, path, retval);
 
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
 	return result;
 }
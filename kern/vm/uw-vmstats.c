@@ -10,15 +10,55 @@
  * with '_' ensure atomicity locally.
  */
 
+/*
+ * The counters are kept per cpu, each cpu's set on its own cache
+ * lines, so counting a fault never touches memory another cpu is
+ * writing. Only the owning cpu writes its set, with interrupts off,
+ * so incrementing needs no lock. The totals are added up when they
+ * are read.
+ *
+ * Each set has a sequence count, bumped to odd before an update and
+ * back to even after it (a seqlock). Readers copy a cpu's counters
+ * and retry if the count was odd or changed meanwhile, so what they
+ * get is a set of values that all existed at the same moment.
+ *
+ * Nothing but the owning cpu ever writes a set, not even to reset
+ * it; a lost update to another cpu's sequence count would leave it
+ * with the wrong parity for good. Instead, resetting records the
+ * current totals in stats_base, and readers subtract that.
+ *
+ * The first VMSTAT_COUNT stats are the fixed ones listed in
+ * uw-vmstats.h; others can be added up to VMSTAT_MAX with
+ * vmstats_register. That's meant to be done while bootstrapping.
+ * A new stat's counters are all still zero, so nobody is counting
+ * it yet; stats_lock only has to keep readers from seeing it
+ * before its name is set.
+ */
+
 #include <types.h>
 #include <lib.h>
 #include <synch.h>
 #include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <platform/maxcpus.h>
 #include <uw-vmstats.h>
 
-/* Counters for tracking statistics */
-static unsigned int stats_counts[VMSTAT_COUNT];
+/* Assumed cache line size; each cpu's counters start on a new line. */
+#define VMSTATS_CACHELINE 64
+
+/* Counters for tracking statistics, for one cpu */
+struct vmstats_cpu {
+  volatile unsigned vc_seq;                  /* odd while updating */
+  volatile unsigned int vc_counts[VMSTAT_MAX];
+} __attribute__((__aligned__(VMSTATS_CACHELINE)));
 
+static struct vmstats_cpu stats_percpu[MAXCPUS];
+
+/* Totals as of the last reset */
+static unsigned int stats_base[VMSTAT_MAX];
+
+/* Protects stats_base and registration; not needed to count */
 struct spinlock stats_lock = SPINLOCK_INITIALIZER;
 
 /* Strings used in printing out the statistics */
@@ -35,15 +75,19 @@ static const char *stats_names[] = {
  /*  9 */ "Swapfile Writes",
 };
 
+/* Names of the stats added with vmstats_register */
+static const char *stats_regnames[VMSTAT_MAX - VMSTAT_COUNT];
+
+/* Number of stats in use, fixed and registered */
+static unsigned stats_num = VMSTAT_COUNT;
+
 
 /* ---------------------------------------------------------------------- */
 /* Assumes vmstat_init has already been called */
 void
 vmstats_inc(unsigned int index)
 {
-    spinlock_acquire(&stats_lock);
-      _vmstats_inc(index);
-    spinlock_release(&stats_lock);
+  _vmstats_inc(index);
 }
 
 /* ---------------------------------------------------------------------- */
@@ -61,51 +105,141 @@ vmstats_init(void)
 }
 
 /* ---------------------------------------------------------------------- */
+/* Add a stat called NAME (which must stay around), and return its
+ * index for vmstats_inc, or -1 if they're all used.
+ */
+int
+vmstats_register(const char *name)
+{
+  int index;
+
+  spinlock_acquire(&stats_lock);
+  if (stats_num >= VMSTAT_MAX) {
+    index = -1;
+  }
+  else {
+    index = stats_num;
+    stats_regnames[index - VMSTAT_COUNT] = name;
+    stats_num++;
+  }
+  spinlock_release(&stats_lock);
+
+  return index;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Doesn't need stats_lock any more, but interrupts go off so we
+ * stay on this cpu and its update can't be interleaved with another.
+ */
 void
 _vmstats_inc(unsigned int index)
 {
-  KASSERT(index < VMSTAT_COUNT);
-  stats_counts[index]++;
+  struct vmstats_cpu *vc;
+  int spl;
+
+  KASSERT(index < VMSTAT_MAX);
+
+  spl = splhigh();
+  vc = &stats_percpu[curcpu->c_number];
+  vc->vc_seq++;
+  vc->vc_counts[index]++;
+  vc->vc_seq++;
+  splx(spl);
 }
 
 /* ---------------------------------------------------------------------- */
+/* Add up every cpu's raw counters, since boot, into TOTALS. */
+static
 void
-_vmstats_init(void)
+vmstats_sum(unsigned int *totals)
 {
-  int i = 0;
+  struct vmstats_cpu *vc;
+  unsigned int counts[VMSTAT_MAX];
+  unsigned seq, i, j;
+
+  for (j=0; j<VMSTAT_MAX; j++) {
+    totals[j] = 0;
+  }
+
+  for (i=0; i<MAXCPUS; i++) {
+    vc = &stats_percpu[i];
+    do {
+      seq = vc->vc_seq;
+      for (j=0; j<VMSTAT_MAX; j++) {
+        counts[j] = vc->vc_counts[j];
+      }
+    } while ((seq & 1) != 0 || vc->vc_seq != seq);
+
+    for (j=0; j<VMSTAT_MAX; j++) {
+      totals[j] += counts[j];
+    }
+  }
+}
 
+/* ---------------------------------------------------------------------- */
+void
+_vmstats_init(void)
+{
   if (sizeof(stats_names) / sizeof(char *) != VMSTAT_COUNT) {
     kprintf("vmstats_init: number of stats_names = %d != VMSTAT_COUNT = %d\n",
       (sizeof(stats_names) / sizeof(char *)), VMSTAT_COUNT);
     panic("Should really fix this before proceeding\n");
   }
 
-  for (i=0; i<VMSTAT_COUNT; i++) {
-    stats_counts[i] = 0;
+  /* Zero is wherever the counters are now. */
+  vmstats_sum(stats_base);
+}
+
+/* ---------------------------------------------------------------------- */
+/* Totals since the last reset, into TOTALS, which has room for
+ * VMSTAT_MAX of them; returns how many stats there are. Holding
+ * stats_lock keeps a reset from coming between the sum and the
+ * subtraction.
+ */
+unsigned
+vmstats_snapshot(unsigned int *totals)
+{
+  unsigned j, num;
+
+  spinlock_acquire(&stats_lock);
+  num = stats_num;
+  vmstats_sum(totals);
+  for (j=0; j<num; j++) {
+    totals[j] -= stats_base[j];
   }
+  spinlock_release(&stats_lock);
 
+  return num;
 }
 
 /* ---------------------------------------------------------------------- */
 /* Assumes vmstat_init has already been called */
-/* NOTE: We do not grab the spinlock here because kprintf may block
- * and we can't block while holding a spinlock.
- * Just use this when there is only one thread remaining.
+/* NOTE: The counts are read through vmstats_snapshot, so this is
+ * safe while other threads are still counting; the totals are just
+ * as of some moment during the call. The cross-checks below only
+ * hold once everyone has stopped.
  */
 
 void
 vmstats_print(void)
 {
-  int i = 0;
+  unsigned int stats_counts[VMSTAT_MAX];
+  unsigned num, i = 0;
+  const char *name;
   int free_plus_replace = 0;
   int disk_plus_zeroed_plus_reload = 0;
   int tlb_faults = 0;
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
 
+  num = vmstats_snapshot(stats_counts);
+
   kprintf("VMSTATS:\n");
-  for (i=0; i<VMSTAT_COUNT; i++) {
-    kprintf("VMSTAT %25s = %10d\n", stats_names[i], stats_counts[i]);
+  for (i=0; i<num; i++) {
+    /* Registered names were set before the snapshot saw them. */
+    name = i < VMSTAT_COUNT ? stats_names[i] :
+      stats_regnames[i - VMSTAT_COUNT];
+    kprintf("VMSTAT %25s = %10d\n", name, stats_counts[i]);
   }
 
   tlb_faults = stats_counts[VMSTAT_TLB_FAULT];
@@ -154,6 +154,14 @@ int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
 int __getcwd(char *buf, size_t buflen);
+
+/*
+ * User-level synchronization support. futex_wait sleeps if *addr is
+ * still EXPECTED (and fails with EAGAIN if not); futex_wake wakes up
+ * to COUNT sleepers on ADDR and returns how many it woke.
+ */
+int futex_wait(volatile int *addr, int expected);
+int futex_wake(volatile int *addr, int count);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
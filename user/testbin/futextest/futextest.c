@@ -0,0 +1,108 @@
+/*
+ * futextest - check the futex_wait and futex_wake system calls.
+ *
+ * Processes don't share memory and the base system has no user
+ * threads, so nobody can be woken: this checks the argument handling
+ * and the paths that don't sleep. futex_wait must fail with EAGAIN
+ * when the word doesn't hold the expected value, and futex_wake with
+ * nobody waiting must wake nobody. Both are run over enough words to
+ * hit every hash bucket in the kernel.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define NWORDS	512
+
+static volatile int words[NWORDS];
+
+static
+void
+check_mismatch(void)
+{
+	unsigned i;
+
+	for (i=0; i<NWORDS; i++) {
+		words[i] = i;
+	}
+	for (i=0; i<NWORDS; i++) {
+		if (futex_wait(&words[i], i + 1) != -1) {
+			errx(1, "futex_wait on a changed word returned");
+		}
+		if (errno != EAGAIN) {
+			err(1, "futex_wait on a changed word: "
+			    "expected EAGAIN, got");
+		}
+		if (words[i] != (int)i) {
+			errx(1, "futex_wait changed word %u to %d",
+			     i, words[i]);
+		}
+	}
+}
+
+static
+void
+check_nowaiters(void)
+{
+	unsigned i;
+	int result;
+
+	for (i=0; i<NWORDS; i++) {
+		result = futex_wake(&words[i], 1);
+		if (result < 0) {
+			err(1, "futex_wake");
+		}
+		if (result != 0) {
+			errx(1, "futex_wake woke %d threads; "
+			     "there were none", result);
+		}
+	}
+	result = futex_wake(&words[0], 0);
+	if (result != 0) {
+		errx(1, "futex_wake with count 0 returned %d", result);
+	}
+}
+
+static
+void
+check_badargs(void)
+{
+	volatile int *misaligned;
+
+	misaligned = (volatile int *)((volatile char *)&words[0] + 1);
+
+	if (futex_wait(misaligned, 0) != -1 || errno != EINVAL) {
+		errx(1, "futex_wait on a misaligned address: "
+		     "expected EINVAL");
+	}
+	if (futex_wake(misaligned, 1) != -1 || errno != EINVAL) {
+		errx(1, "futex_wake on a misaligned address: "
+		     "expected EINVAL");
+	}
+	if (futex_wake(&words[0], -1) != -1 || errno != EINVAL) {
+		errx(1, "futex_wake with a negative count: "
+		     "expected EINVAL");
+	}
+	if (futex_wait((volatile int *)0x80000000, 0) != -1 ||
+	    errno != EFAULT) {
+		errx(1, "futex_wait on a kernel address: expected EFAULT");
+	}
+}
+
+int
+main(void)
+{
+	printf("futextest: phase 1: value mismatch\n");
+	check_mismatch();
+
+	printf("futextest: phase 2: waking nobody\n");
+	check_nowaiters();
+
+	printf("futextest: phase 3: bad arguments\n");
+	check_badargs();
+
+	printf("futextest: passed\n");
+	return 0;
+}